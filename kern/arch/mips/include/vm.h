@@ -90,6 +90,17 @@
  #define USERSTACKREDZONE	65536
  #define USERHEAPSTART 536870912
 
+ // mmap hands out addresses top down from under the stack's redzone
+ #define USERMMAPTOP	(USERSTACKBASE-USERSTACKREDZONE)
+
+/*
+ * The page directory (see pagetable.h) of the address space each CPU is
+ * running, or NULL. The UTLB refill handler in exception-mips1.S walks it
+ * to load TLB entries without going through vm_fault.
+ */
+struct page_entry;
+extern struct page_entry ***utlb_pagedirs[];
+
 /*
  * Interface to the low-level module that looks after the amount of
  * physical memory we have.
@@ -120,14 +131,24 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown carries a batch of up to TLBSHOOTDOWN_BATCH pages of one
+ * address space, or of whatever address space maps them if ts_as is NULL.
+ * TLBSHOOTDOWN_ALL in ts_npages drops all of ts_as instead. The sender
+ * waits on ts_ack until every target has handled it. A CPU can have up
+ * to 16 shootdowns queued.
  */
 
+struct addrspace;
+struct tlbshootdown_ack;
+
+#define TLBSHOOTDOWN_BATCH 8
+#define TLBSHOOTDOWN_ALL   ((unsigned)-1)
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	unsigned ts_npages;
+	vaddr_t ts_vaddrs[TLBSHOOTDOWN_BATCH];
+	struct tlbshootdown_ack *ts_ack;
 };
 
 #define TLBSHOOTDOWN_MAX 16
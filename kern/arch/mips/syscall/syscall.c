@@ -82,6 +82,7 @@ syscall(struct trapframe *tf)
 	int32_t retval;
 	int64_t retval_64;
 	int64_t pos;
+	int mmap_fd;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -176,6 +177,57 @@ syscall(struct trapframe *tf)
       retval = (int) sys_sbrk((int)tf->tf_a0, &err);
       break;
 
+		case SYS_mmap:
+			// fd is the fifth argument, and the 64-bit offset comes after
+			// it, aligned to 8 bytes
+			mmap_fd = -1;
+			pos = 0;
+			err = copyin((const_userptr_t) (tf->tf_sp + 16), &mmap_fd,
+				     sizeof(mmap_fd));
+			if (!err) {
+				err = copyin((const_userptr_t) (tf->tf_sp + 24), &pos,
+					     sizeof(pos));
+			}
+			if (!err) {
+				retval = (int) sys_mmap((void *)tf->tf_a0, (size_t)tf->tf_a1,
+							(int)tf->tf_a2, (int)tf->tf_a3, mmap_fd,
+							(off_t)pos, &err);
+			}
+			break;
+
+		case SYS_munmap:
+			retval = sys_munmap((void *)tf->tf_a0, (size_t)tf->tf_a1, &err);
+			break;
+
+		case SYS_madvise:
+			retval = sys_madvise((void *)tf->tf_a0, (size_t)tf->tf_a1,
+					     (int)tf->tf_a2, &err);
+			break;
+
+		case SYS_mincore:
+			retval = sys_mincore((void *)tf->tf_a0, (size_t)tf->tf_a1,
+					     (char *)tf->tf_a2, &err);
+			break;
+
+		case SYS_shmget:
+			retval = sys_shmget((int)tf->tf_a0, (size_t)tf->tf_a1,
+					    (int)tf->tf_a2, &err);
+			break;
+
+		case SYS_shmat:
+			retval = (int) sys_shmat((int)tf->tf_a0, (void *)tf->tf_a1,
+						 (int)tf->tf_a2, &err);
+			break;
+
+		case SYS_shmdt:
+			retval = sys_shmdt((void *)tf->tf_a0, &err);
+			break;
+
+		case SYS_shmctl:
+			retval = sys_shmctl((int)tf->tf_a0, (int)tf->tf_a1,
+					    (struct shmid_ds *)tf->tf_a2, &err);
+			break;
+
 		default:
 			kprintf("Unknown syscall %d\n", callno);
 			err = ENOSYS;
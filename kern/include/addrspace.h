@@ -39,29 +39,73 @@
 #include <vm.h>
 #include "opt-dumbvm.h"
 #include <array.h>
+#include <pagetable.h>
+#include <platform/maxcpus.h>
 
 
 struct vnode;
+struct text_page;
+struct shm_segment;
+struct rwlock;
+struct lock;
 
 
-// Page table entry
-struct page_entry {
-  // State of the page
-  enum pageStateEnum {DIRTY, CLEAN} state;
+// State of a page. A CLEAN page has an up to date copy in its swap slot
+// and is mapped read-only, so the first write to it faults and makes it
+// DIRTY again (giving up the slot). DIRTY pages have no swap slot while
+// resident.
+enum pageStateEnum {DIRTY, CLEAN};
 
-  enum swapStateEnum {MEMORY, DISK} swap_state;
+enum swapStateEnum {MEMORY, DISK};
 
-  // Virtual page this maps to
-  vaddr_t vpage_n;
+// Page table entry. There is one of these for every page of every process,
+// so it is kept small enough for a 32-byte kmalloc block.
+struct page_entry {
+  // The TLB entry (EntryLo) the UTLB refill handler loads for this page, or
+  // 0 to make it go through vm_fault instead. Only valid while the page is
+  // resident and referenced. This has to be the first field.
+  uint32_t pte;
 
   // Physical Page this maps to
   paddr_t ppage_n;
 
-  // This will also need the location on disk (if on disk)
+  // Virtual page this maps to
+  vaddr_t vpage_n;
+
+  // Swap slot, valid while the page is on disk or CLEAN
   unsigned int bitmap_disk_index;
 
-  struct lock * swap_lock;
+  // Number of page tables holding this page. After fork, parent and child
+  // share their pages (refcount > 1) copy-on-write: shared pages are mapped
+  // read-only, and the first write to one in either process gives that
+  // process a private copy.
+  unsigned int refcount;
+
+  // For shared text pages, where in which file the page comes from (see
+  // textcache.h). Such pages have no swap slot and are read back from the
+  // file. They are CLEAN unless they belong to a MAP_SHARED mapping, whose
+  // writes go back to the file instead. NULL for everything else.
+  struct text_page * text;
 
+  // Swap hint of the address space that created the page, so its slots
+  // end up near that address space's other ones (see swapmap.h)
+  uint16_t swap_hint;
+
+  // enum pageStateEnum and enum swapStateEnum
+  uint8_t state;
+  uint8_t swap_state;
+
+  // Loaded into the TLB by fault-around instead of by a fault on the page
+  // itself (see vm_fault_around). Protected by the coremap's resident lock.
+  bool prefetched;
+
+  // Brought in from swap by another page's fault and not touched since (see
+  // swap_in). Protected by the coremap's resident lock.
+  bool readahead;
+
+  // Set while somebody holds the page lock (see page_lock), which protects
+  // the swap state and refcount of the page
+  bool locked;
 };
 
 struct segment_entry {
@@ -69,14 +113,33 @@ struct segment_entry {
     vaddr_t region_start;
     // Size of the region
     size_t region_size;
-    // Page table for the heap
-    struct array * page_table;
 
     // What type of segment is this?
     int readable;
     int writeable;
     int executable;
     bool isHeap;
+
+    // Made by mmap, and so something munmap may take away again. Pages of
+    // a shared mapping come from the text cache whether it is writeable or
+    // not, so that everybody mapping the file sees the same ones.
+    bool isMmap;
+    bool isShared;
+
+    // Shared memory segment the pages come from, if attached with shmat.
+    // Those are shared too, but munmap leaves them alone (see as_shmdt).
+    struct shm_segment * shm;
+
+    // How the segment's pages are going to be used (MADV_NORMAL,
+    // MADV_RANDOM or MADV_SEQUENTIAL; see vm_madvise)
+    int advice;
+
+    // File the first file_size bytes of the segment are paged in from,
+    // starting at file_offset, or NULL if it is all zero-fill. Pages are
+    // read in when they are first touched (see as_map_file).
+    struct vnode * file_vnode;
+    off_t file_offset;
+    size_t file_size;
 };
 
 
@@ -99,9 +162,53 @@ struct addrspace {
   paddr_t as_stackpbase;
 #else
 
+  // Protects the segment list and the shape of the page table. Faults hold
+  // it for reading, so faults on different pages go ahead in parallel;
+  // adding, resizing or removing segments and unmapping pages hold it for
+  // writing.
+  struct rwlock * as_lock;
+
+  // Serializes faults adding and replacing page table entries, since they
+  // only hold as_lock for reading. Lookups don't need it: leaves and
+  // entries are single words, and are only freed with as_lock held for
+  // writing.
+  struct lock * as_ptlock;
+
   // The segments this address space has
   struct array * segments_list;
 
+  // The pages mapped in those segments
+  struct pagetable as_pt;
+
+  // TLB address space ID on each CPU, and the ASID generation it belongs
+  // to (see vm_tlb_activate)
+  unsigned int as_asids[MAXCPUS];
+  unsigned int as_asid_gens[MAXCPUS];
+
+  // CPUs whose TLB may hold entries for this address space
+  uint32_t as_cpus;
+
+  // Groups our pages' swap slots together (see swapmap.h)
+  uint16_t as_swap_hint;
+
+  // Fault-around window, and how the recent prefetches turned out (see
+  // vm_fault_around)
+  unsigned int as_fa_window;
+  unsigned int as_fa_cooldown;
+  unsigned int as_fa_prefetched;
+  unsigned int as_fa_wasted;
+
+  // Next address space waiting for the reaper (see vm_reap)
+  struct addrspace * as_reap_next;
+
+  // Load control (see loadctl_fault): faults in the current period, when
+  // we were suspended, and the next suspended address space
+  unsigned int as_lc_period;
+  unsigned int as_lc_faults;
+  unsigned int as_lc_since;
+  bool as_lc_suspended;
+  struct addrspace * as_lc_next;
+
 #endif
 };
 
@@ -129,9 +236,30 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_reap   - free the pages and the rest of an address space that
+ *                as_destroy has finished with; see vm_reap.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_map_file - back the start of the region at VADDR with part of a
+ *                file, which gets read in a page at a time as the pages
+ *                are touched.
+ *
+ *    as_mmap   - add a region of LEN bytes for mmap, at *VADDR if FIXED
+ *                and wherever there is room otherwise, optionally backed
+ *                by a file like with as_map_file. Hands back the address
+ *                in *VADDR.
+ *
+ *    as_munmap - remove the mmap'd pages in the LEN bytes at VADDR,
+ *                shrinking or splitting the regions they were in.
+ *
+ *    as_shmat  - attach a shared memory segment, at *VADDR if FIXED and
+ *                wherever there is room otherwise, taking over a
+ *                reference to it. Hands back the address in *VADDR.
+ *
+ *    as_shmdt  - detach the shared memory segment attached at VADDR.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -151,12 +279,25 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_reap(struct addrspace *);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_map_file(struct addrspace *as, vaddr_t vaddr,
+                              struct vnode *v, off_t offset,
+                              size_t filesize);
+int               as_mmap(struct addrspace *as, vaddr_t *vaddr,
+                          size_t len, int readable, int writeable,
+                          int executable, bool shared, bool fixed,
+                          struct vnode *v, off_t offset, size_t filesize);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_shmat(struct addrspace *as, vaddr_t *vaddr,
+                           struct shm_segment *shm, bool readonly,
+                           bool fixed);
+int               as_shmdt(struct addrspace *as, vaddr_t vaddr);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
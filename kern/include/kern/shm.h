@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SHM_H_
+#define _KERN_SHM_H_
+
+/*
+ * Definitions for the System V style shared memory calls, shmget(),
+ * shmat(), shmdt() and shmctl(). Keys are plain ints.
+ */
+
+/* Key that always makes a new segment */
+#define IPC_PRIVATE   0
+
+/* Flags for shmget */
+#define IPC_CREAT     0x200  /* Create the segment if the key has none */
+#define IPC_EXCL      0x800  /* With IPC_CREAT, fail if it already exists */
+
+/* Flags for shmat */
+#define SHM_RDONLY    0x1000 /* Attach read-only */
+
+/* Commands for shmctl */
+#define IPC_RMID      0      /* Remove once the last process detaches */
+#define IPC_STAT      2      /* Fill in the struct shmid_ds */
+
+struct shmid_ds {
+	size_t shm_segsz;      /* size of the segment in bytes */
+	unsigned shm_nattch;   /* number of attachments */
+};
+
+
+#endif /* _KERN_SHM_H_ */
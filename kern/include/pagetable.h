@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table, one per address space.
+ *
+ * A user virtual address splits 10/10/12 the way MIPS does it: the top 10
+ * bits pick a leaf out of the directory, the next 10 bits pick a page entry
+ * out of the leaf, and the rest is the offset into the page. Leaves cover
+ * 4M each and are only allocated once something is mapped in them, so
+ * sparse regions like the heap and the stack cost nothing where they are
+ * unused.
+ *
+ * Functions:
+ *     pt_init          - set up an empty page table.
+ *     pt_lookup        - find the page mapped at a virtual address, or NULL.
+ *     pt_insert        - map a page at a virtual address that has none.
+ *                        Returns ENOMEM if a leaf can't be allocated.
+ *     pt_replace       - swap the page mapped at a virtual address for
+ *                        another one.
+ *     pt_share         - map every page of one page table into another
+ *                        (which must be empty), adding a reference to each.
+ *     pt_release_range - unmap and page_release every page in a range of
+ *                        virtual addresses, freeing leaves that empty out.
+ *                        If the page table belongs to a live address
+ *                        space, pass it, and the TLB entries get shot down
+ *                        before any page or leaf is freed. Must not be
+ *                        called with a spinlock held.
+ *     pt_foreach       - call a function on every page that is mapped.
+ *     pt_count         - count the pages mapped.
+ *
+ * Lookups take no lock. Faults hold the address space's as_lock for
+ * reading and as_ptlock around pt_insert; anything that removes or
+ * replaces entries or frees leaves holds as_lock for writing. The MIPS
+ * UTLB refill handler walks pt_leaves directly (see utlb_pagedirs), so its
+ * layout is fixed.
+ */
+
+#include <machine/vm.h>
+
+struct page_entry;
+struct addrspace;
+
+#define PT_LEAF_BITS   10
+#define PT_LEAF_SIZE   (1 << PT_LEAF_BITS)        /* page entries per leaf */
+#define PT_LEAF_SPAN   (PT_LEAF_SIZE * PAGE_SIZE) /* bytes mapped per leaf */
+#define PT_DIR_SIZE    (USERSPACETOP / PT_LEAF_SPAN)
+
+#define PT_DIR_INDEX(va)   ((va) / PT_LEAF_SPAN)
+#define PT_LEAF_INDEX(va)  (((va) / PAGE_SIZE) & (PT_LEAF_SIZE - 1))
+
+struct pagetable {
+	/* Leaves, each an array of PT_LEAF_SIZE page entry pointers */
+	struct page_entry **pt_leaves[PT_DIR_SIZE];
+
+	/* Number of pages mapped in each leaf */
+	uint16_t pt_counts[PT_DIR_SIZE];
+};
+
+void pt_init(struct pagetable *pt);
+struct page_entry *pt_lookup(struct pagetable *pt, vaddr_t vaddr);
+int pt_insert(struct pagetable *pt, vaddr_t vaddr, struct page_entry *page);
+void pt_replace(struct pagetable *pt, vaddr_t vaddr, struct page_entry *page);
+int pt_share(struct pagetable *dst, struct pagetable *src);
+void pt_release_range(struct pagetable *pt, vaddr_t start, vaddr_t end,
+		      struct addrspace *as);
+void pt_foreach(struct pagetable *pt,
+		void (*func)(vaddr_t, struct page_entry *, void *),
+		void *data);
+unsigned int pt_count(struct pagetable *pt);
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory segments (shmget and friends).
+ *
+ * A segment is a run of anonymous pages that it keeps itself, so that
+ * every address space it is attached to maps the same ones. A page is
+ * made, zeroed, the first time it is touched through any attachment.
+ * Besides a reference for each page table mapping it, every page has one
+ * for the segment, which keeps it (and what is in it) around while
+ * nobody has it mapped. Pages are shared the way fork shares them,
+ * except that writing to one doesn't break the sharing, and get evicted
+ * to swap like any other page. A segment goes away once it has been
+ * removed and the last attachment is gone.
+ *
+ * Functions:
+ *     shm_bootstrap  - set up the segment table.
+ *     shm_get        - find the segment with KEY, or make one of SIZE
+ *                      bytes, the way shmget does with FLAGS. Hands back
+ *                      its id.
+ *     shm_attach     - get the segment with id ID with a reference added
+ *                      for a new attachment, or NULL if there is none.
+ *     shm_ref        - add a reference for a copy of an attachment.
+ *     shm_detach     - drop an attachment's reference.
+ *     shm_remove     - remove the segment with id ID (IPC_RMID).
+ *     shm_stat       - describe the segment with id ID (IPC_STAT).
+ *     shm_size       - get a segment's size in bytes.
+ *     shm_getpage    - get page INDEX of a segment with a reference added
+ *                      for the caller's page table, making it if nobody
+ *                      has touched it yet. New pages use swap hint HINT.
+ *                      Returns NULL if out of memory.
+ *     shm_printstats - print statistics for vmstat.
+ */
+
+#include <types.h>
+
+struct page_entry;
+struct shm_segment;
+struct shmid_ds;
+
+void shm_bootstrap(void);
+int shm_get(int key, size_t size, int flags, int *id);
+struct shm_segment *shm_attach(int id);
+void shm_ref(struct shm_segment *shm);
+void shm_detach(struct shm_segment *shm);
+int shm_remove(int id);
+int shm_stat(int id, struct shmid_ds *ds);
+size_t shm_size(struct shm_segment *shm);
+struct page_entry *shm_getpage(struct shm_segment *shm, unsigned int index,
+                               uint16_t hint);
+void shm_printstats(void);
+
+#endif /* _SHM_H_ */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAPMAP_H_
+#define _SWAPMAP_H_
+
+/*
+ * Swap slot allocator.
+ *
+ * Swap is carved into clusters of SWAPMAP_CLUSTER contiguous slots. Each
+ * address space (really each swap hint; see as_swap_hint) fills one
+ * cluster at a time, so the pages a process gets evicted end up next to
+ * each other on disk. A two-level summary of which clusters are empty and
+ * which have any free slots at all finds a new cluster without scanning
+ * the slot bitmap.
+ *
+ * Functions:
+ *     swapmap_bootstrap   - set up a map of NSLOTS slots.
+ *     swapmap_alloc       - allocate a slot, close to the last one handed
+ *                           out for HINT. Returns ENOSPC if swap is full.
+ *     swapmap_free        - free a slot.
+ *     swapmap_isset       - check a slot is allocated.
+ *     swapmap_close       - HINT won't be allocating any more; stop
+ *                           keeping a cluster open for it.
+ *     swapmap_batch_add   - free a slot later, along with the rest of the
+ *                           batch, when the batch fills up or is flushed.
+ *     swapmap_batch_flush - free the slots in a batch.
+ *     swapmap_printstats  - print statistics for vmstat.
+ *
+ * Batches are for freeing lots of slots at once, like when a process
+ * exits, without taking the lock for every one of them.
+ */
+
+#include <types.h>
+
+#define SWAPMAP_CLUSTER 32
+#define SWAPMAP_BATCH   64
+
+struct swapmap_batch {
+	unsigned int sb_count;
+	unsigned int sb_slots[SWAPMAP_BATCH];
+};
+
+#define SWAPMAP_BATCH_INITIALIZER { 0, { 0 } }
+
+void swapmap_bootstrap(unsigned int nslots);
+int swapmap_alloc(unsigned int hint, unsigned int *slot);
+void swapmap_free(unsigned int slot);
+bool swapmap_isset(unsigned int slot);
+void swapmap_close(unsigned int hint);
+void swapmap_batch_add(struct swapmap_batch *batch, unsigned int slot);
+void swapmap_batch_flush(struct swapmap_batch *batch);
+void swapmap_printstats(void);
+
+#endif /* _SWAPMAP_H_ */
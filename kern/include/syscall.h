@@ -35,6 +35,7 @@
 #include <spl.h>
 #include <addrspace.h>
 struct trapframe; /* from <machine/trapframe.h> */
+struct shmid_ds; /* from <kern/shm.h> */
 
 struct f_handler {
     struct lock *fh_lock;   // Lock for logistics
@@ -168,4 +169,20 @@ void * sys_sbrk(intptr_t, int *);
 
 struct segment_entry * find_heap_segment(void);
 
+void * sys_mmap(void *, size_t, int, int, int, off_t, int *);
+
+int sys_munmap(void *, size_t, int *);
+
+int sys_madvise(void *, size_t, int, int *);
+
+int sys_mincore(void *, size_t, char *, int *);
+
+int sys_shmget(int, size_t, int, int *);
+
+void * sys_shmat(int, void *, int, int *);
+
+int sys_shmdt(void *, int *);
+
+int sys_shmctl(int, int, struct shmid_ds *, int *);
+
 #endif /* _SYSCALL_H_ */
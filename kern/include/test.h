@@ -118,6 +118,10 @@ int kmalloctest4(int, char **);
 int kmalloctest5(int, char **);
 int nettest(int, char **);
 
+/* VM tests */
+int coremapbench(int, char **);
+int vmfaulttest(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
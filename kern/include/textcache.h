@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared text pages.
+ *
+ * Pages of read-only segments that come straight from an executable are
+ * kept in a cache keyed by vnode and file offset, so that every process
+ * running the same binary maps the same page instead of reading its own
+ * copy. The pages are reference counted like pages shared by fork, and
+ * live as long as some page table holds them. Under memory pressure they
+ * get evicted like any other page, except that they are always CLEAN and
+ * come back from the executable rather than from swap.
+ *
+ * Pages of MAP_SHARED file mappings live here too, under the address
+ * TEXTCACHE_ANYWHERE since every process may map them somewhere else.
+ * Those can be written: a dirty one is written back to its file when it
+ * is evicted or its last mapping goes away.
+ *
+ * Functions:
+ *     textcache_bootstrap  - set up the cache.
+ *     textcache_get        - get the page of file V at OFFSET mapped at
+ *                            VADDR with a reference added, creating it
+ *                            (not resident yet) if nobody has it. Returns
+ *                            NULL if out of memory.
+ *     textcache_put        - drop a reference to a cached page. Returns
+ *                            true, with the page no longer in the cache,
+ *                            if that was the last one.
+ *     textcache_read       - read a cached page's contents from its file
+ *                            into the frame at PADDR.
+ *     textcache_write      - write a resident cached page back to its
+ *                            file, leaving out anything past its end.
+ *     textcache_printstats - print statistics for vmstat.
+ */
+
+#include <types.h>
+
+struct vnode;
+struct page_entry;
+
+/* The address pages of shared mappings are cached under (VPAGE_ANYWHERE) */
+#define TEXTCACHE_ANYWHERE 0
+
+void textcache_bootstrap(void);
+struct page_entry *textcache_get(struct vnode *v, off_t offset, vaddr_t vaddr);
+bool textcache_put(struct page_entry *page);
+void textcache_read(struct page_entry *page, paddr_t paddr);
+void textcache_write(struct page_entry *page);
+void textcache_printstats(void);
+
+#endif /* _TEXTCACHE_H_ */
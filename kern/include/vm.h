@@ -30,6 +30,7 @@
 #ifndef _VM_H_
 #define _VM_H_
 #include <addrspace.h>
+#include <swapmap.h>
 #include <machine/vm.h>
 
 /* Fault-type arguments to vm_fault() */
@@ -37,18 +38,51 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-// Structure for coremap entry
-struct coremap_page {
+struct addrspace;
+struct segment_entry;
 
-    // Current state of this block
-    enum stateEnum {FREE, KERNEL, USER} state;
+// Structure for coremap entry. There is one per page of physical memory,
+// so it is kept small.
+struct coremap_page {
 
     struct page_entry * owner;
 
+    // Address space that alone maps owner, or NULL if others may too (see
+    // page_set_owner). Evicting the page only has to shoot down its CPUs.
+    struct addrspace * as;
+
+    // Links for the buddy allocator's free list while free_head, or for the
+    // resident queue while resident. A page is never on both.
+    int next;
+    int prev;
+
     // Series of blocks following this page:
-    unsigned long block_size;
+    uint32_t block_size;
+
+    // Page replacement bookkeeping for USER pages. Resident pages that can
+    // be evicted sit on a queue that the replacement policy walks. A busy
+    // page is being evicted or is pinned, and is off the queue until it is
+    // done.
+    uint32_t last_use;
+
+    // Current state of this block (enum stateEnum)
+    uint8_t state;
+
+    // Buddy allocator bookkeeping. Only the first page of a free block
+    // (free_head) is on a free list, and it records the order of the block.
+    uint8_t order;
+    bool free_head;
+
+    bool resident;
+    bool referenced;
+    bool busy;
 };
 
+enum stateEnum {FREE, KERNEL, USER};
+
+// Largest block the buddy allocator tracks (2^10 pages = 4MB)
+#define COREMAP_MAX_ORDER 10
+
 // Starting address for the coremap
 paddr_t coremap_startaddr;
 
@@ -57,15 +91,17 @@ paddr_t coremap_pagestartaddr;
 
 // Swap stuff
 struct vnode * swap_vnode;
-struct bitmap * disk_bitmap;
-struct lock * bitmap_lock;
 bool can_swap;
 unsigned long swap_disk_pages;
 
+// Most pages moved to or from swap in one transfer
+#define SWAP_IO_MAX 8
+
 int block_read(unsigned int, paddr_t);
 int block_write(unsigned int, paddr_t);
-int swap_in(struct page_entry *);
-int swap_out(struct page_entry *);
+bool swap_in(struct addrspace *, struct segment_entry *, struct page_entry *,
+             paddr_t);
+void swap_out_batch(struct page_entry **, unsigned int, int *, bool);
 
 
 // The number of pages in the coremap
@@ -93,16 +129,143 @@ void vm_bootstrap(void);
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
 struct segment_entry * find_segment_from_vaddr(vaddr_t);
-struct page_entry * find_page_on_segment(struct segment_entry *, vaddr_t);
+struct segment_entry * find_segment(struct addrspace *, vaddr_t);
+struct segment_entry * find_segment_overlap(struct addrspace *, vaddr_t,
+                                            vaddr_t);
 
-/* Helper function to get 'n' number of physical pages */
-paddr_t getppages(unsigned long, bool);
+/*
+ * vpage_n of pages that can be mapped at different addresses in different
+ * address spaces: those of shared file mappings (see textcache.h) and of
+ * shared memory segments (see shm.h). TLB shootdowns for them have to
+ * flush everything.
+ */
+#define VPAGE_ANYWHERE 0
 
-void set_page_owner(struct page_entry *, paddr_t);
+/*
+ * Application advice (see madvise and mincore). Both take a page aligned
+ * range that is all mapped, failing with ENOMEM otherwise.
+ */
+int vm_madvise(struct addrspace *, vaddr_t, size_t, int advice);
+int vm_mincore(struct addrspace *, vaddr_t, unsigned int npages, char *vec);
+
+/*
+ * Helper function to get 'n' number of physical pages. Pages come back
+ * zeroed unless VM_ALLOC_NOZERO is given, which callers that overwrite the
+ * whole page anyway should pass.
+ */
+#define VM_ALLOC_KERNEL 0x1     /* Page belongs to the kernel, not a user */
+#define VM_ALLOC_NOZERO 0x2     /* Don't bother zeroing the page */
+#define VM_ALLOC_NOEVICT 0x4    /* Fail rather than evict or drain caches */
+paddr_t getppages(unsigned long, int flags);
+
+void set_page_owner(struct page_entry *, paddr_t, struct addrspace *);
+
+/*
+ * Page locks. Each page has a lock bit (see struct page_entry) instead of a
+ * lock of its own; waiters sleep on one of a few wait channels the pages
+ * hash to. A page lock may be held while sleeping.
+ */
+void page_lock(struct page_entry *);
+void page_unlock(struct page_entry *);
 
 /* Free page */
 void freeppage(paddr_t);
 
+/*
+ * Drop a reference to a user page. The last reference frees whatever backs
+ * the page (its frame and/or swap slot) and the page entry itself.
+ */
+void page_release(struct page_entry *);
+
+/*
+ * Pages whose last reference is gone, waiting to be freed together. Their
+ * frames go back to the coremap with one acquisition of each lock per
+ * batch, and their swap slots go to the swap map the same way.
+ */
+#define PAGE_FREE_BATCH 32
+
+struct page_free_batch {
+    unsigned int pfb_count;
+    struct page_entry * pfb_pages[PAGE_FREE_BATCH];
+    struct swapmap_batch pfb_slots;
+};
+
+#define PAGE_FREE_BATCH_INITIALIZER { 0, { NULL }, SWAPMAP_BATCH_INITIALIZER }
+
+/*
+ * Same as page_release, but if this was the last reference the page is
+ * freed along with the rest of the batch, when the batch fills up or is
+ * flushed.
+ */
+void page_release_batch(struct page_entry *, struct page_free_batch *);
+void page_free_batch_flush(struct page_free_batch *);
+
+/*
+ * Free the pages of a dying address space's page table, and then the
+ * address space itself with as_reap. Big ones are handed to the reaper
+ * thread so the exiting process doesn't have to wait.
+ */
+void vm_reap(struct addrspace *);
+
+/*
+ * Turn load control on or off. It suspends processes while the system is
+ * thrashing, and needs swap.
+ */
+int vm_setloadctl(bool enabled);
+
+/*
+ * Switch this CPU's TLB over to an address space, giving it an ASID first
+ * if need be.
+ */
+void vm_tlb_activate(struct addrspace *);
+
+/*
+ * Drop an address space's TLB entries for [start, end) on every CPU that
+ * may have them. Must not be called with a spinlock held.
+ */
+void vm_tlb_invalidate_range(struct addrspace *, vaddr_t start, vaddr_t end);
+
+/* Add a reference to a user page that is now shared copy-on-write */
+void page_share(struct page_entry *);
+
+/*
+ * Keep a resident user page from being evicted while the kernel reads it
+ * directly. vm_page_pin returns false (and pins nothing) if the page is
+ * on disk.
+ */
+bool vm_page_pin(struct page_entry *);
+void vm_page_unpin(struct page_entry *);
+
+/*
+ * Select the page replacement policy ("fifo", "clock" or "wsclock"). A
+ * nonzero tau sets the WSClock working set window, measured in faults.
+ */
+int vm_setpolicy(const char *name, unsigned long tau);
+
+/*
+ * Set the most neighbouring pages a fault may preload into the TLB. 0 turns
+ * fault-around off.
+ */
+int vm_setfaultaround(unsigned int pages);
+
+/*
+ * Set the most pages that may be read ahead from swap along with a faulting
+ * one. 0 turns readahead off.
+ */
+int vm_setreadahead(unsigned int pages);
+
+/*
+ * Set the size, in pages, from which an exiting address space is freed by
+ * the reaper thread instead of the exiting process. 0 turns the reaper off.
+ */
+void vm_setreaper(unsigned int pages);
+
+/*
+ * Set the pageout daemon's watermarks, in pages. The daemon wakes when fewer
+ * than low pages are free and evicts until high pages are free.
+ */
+int vm_setwatermarks(unsigned int low, unsigned int high);
+
 // Helper function to get physical address from virtual address.
 // paddr_t get_paddr_from_vaddr(vaddr_t vaddr);
 
@@ -120,6 +283,9 @@ void free_kpages(vaddr_t vaddr);
  */
 unsigned int coremap_used_bytes(void);
 
+/* Print VM statistics (page caches, ...) for the vmstat menu command */
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ZPOOL_H_
+#define _ZPOOL_H_
+
+/*
+ * Compressed swap cache.
+ *
+ * An optional pool of kernel pages that sits in front of the swap disk.
+ * Evicted pages are compressed into it, keyed by the swap slot they were
+ * given, instead of being written out. When the pool is full, the oldest
+ * pool page's contents are written back to their slots on disk to make
+ * room. Pages that don't compress to at most ZPOOL_MAX_BYTES go straight
+ * to disk.
+ *
+ * Functions:
+ *     zpool_bootstrap   - set up for a swap disk of NSLOTS slots. The pool
+ *                         starts out empty and disabled.
+ *     zpool_setpercent  - size the pool to PERCENT of physical memory,
+ *                         writing back whatever is in it first. 0 turns
+ *                         it off.
+ *     zpool_store       - compress the page at PADDR into the pool as
+ *                         SLOT's contents. Returns false if the pool is
+ *                         off or the page doesn't compress well enough,
+ *                         in which case the caller writes it to disk.
+ *     zpool_load        - if SLOT's contents are in the pool, decompress
+ *                         them into PADDR, forget them, and return true.
+ *     zpool_read        - like zpool_load, but leave SLOT's contents in
+ *                         the pool.
+ *     zpool_contains    - check whether SLOT's contents are in the pool,
+ *                         rather than on disk.
+ *     zpool_drop        - forget SLOT's contents, if they are in the pool.
+ *     zpool_printstats  - print statistics for vmstat.
+ *
+ * The caller holds the lock of the page owning the slot, except for
+ * zpool_contains. Pages are written back without their owners' locks; a
+ * slot is only forgotten once its contents are safely on disk.
+ */
+
+#include <types.h>
+
+#define ZPOOL_MAX_BYTES (PAGE_SIZE * 3 / 4)
+#define ZPOOL_MAX_PERCENT 50
+
+void zpool_bootstrap(unsigned int nslots);
+int zpool_setpercent(unsigned int percent);
+bool zpool_store(unsigned int slot, paddr_t paddr);
+bool zpool_load(unsigned int slot, paddr_t paddr);
+bool zpool_read(unsigned int slot, paddr_t paddr);
+bool zpool_contains(unsigned int slot);
+void zpool_drop(unsigned int slot);
+void zpool_printstats(void);
+
+#endif /* _ZPOOL_H_ */
@@ -45,6 +45,8 @@
 #include <syscall.h>
 #include <test.h>
 #include <prompt.h>
+#include <vm.h>
+#include <zpool.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-synchprobs.h"
@@ -527,6 +529,176 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for choosing the page replacement policy.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	unsigned long tau = 0;
+
+	if (nargs < 2 || nargs > 3) {
+		kprintf("Usage: vmpolicy fifo|clock|wsclock [tau]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 3) {
+		tau = atoi(args[2]);
+		if (tau == 0) {
+			kprintf("vmpolicy: tau must be positive\n");
+			return EINVAL;
+		}
+	}
+
+	if (vm_setpolicy(args[1], tau)) {
+		kprintf("vmpolicy: unknown policy %s\n", args[1]);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for setting how many neighbouring pages a fault may preload.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: faultaround pages\n");
+		return EINVAL;
+	}
+
+	if (vm_setfaultaround(atoi(args[1]))) {
+		kprintf("faultaround: too many pages\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for setting how many pages may be read ahead from swap.
+ */
+static
+int
+cmd_swapreadahead(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapra pages\n");
+		return EINVAL;
+	}
+
+	if (vm_setreadahead(atoi(args[1]))) {
+		kprintf("swapra: too many pages\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for sizing the compressed swap cache.
+ */
+static
+int
+cmd_zpool(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: zpool percent\n");
+		return EINVAL;
+	}
+
+	result = zpool_setpercent(atoi(args[1]));
+	if (result) {
+		kprintf("zpool: %s\n", strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for setting how big an address space has to be for the reaper
+ * thread to free it.
+ */
+static
+int
+cmd_reaper(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: reaper pages\n");
+		return EINVAL;
+	}
+
+	vm_setreaper(atoi(args[1]));
+	return 0;
+}
+
+/*
+ * Command for turning load control on and off.
+ */
+static
+int
+cmd_loadctl(int nargs, char **args)
+{
+	bool enabled;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		enabled = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		enabled = false;
+	}
+	else {
+		kprintf("Usage: loadctl on|off\n");
+		return EINVAL;
+	}
+
+	if (vm_setloadctl(enabled)) {
+		kprintf("loadctl: no swap\n");
+		return ENOSYS;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for setting the pageout daemon's free page watermarks.
+ */
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	if (nargs != 3) {
+		kprintf("Usage: pageout low high\n");
+		return EINVAL;
+	}
+
+	if (vm_setwatermarks(atoi(args[1]), atoi(args[2]))) {
+		kprintf("pageout: need 0 < low < high <= total pages\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -594,6 +766,8 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[cmb] Coremap alloc benchmark       ",
+	"[vmf] Concurrent VM fault test      ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -678,6 +852,14 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vmstat] VM statistics              ",
+	"[vmpolicy] Page replacement policy  ",
+	"[pageout] Pageout watermarks        ",
+	"[faultaround] Fault-around pages    ",
+	"[swapra] Swap readahead pages       ",
+	"[zpool] Compressed swap cache size  ",
+	"[reaper] Background reaper pages    ",
+	"[loadctl] Load control on/off       ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -733,6 +915,14 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vmstat",     cmd_vmstat },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "pageout",    cmd_pageout },
+	{ "faultaround", cmd_faultaround },
+	{ "swapra",     cmd_swapreadahead },
+	{ "zpool",      cmd_zpool },
+	{ "reaper",     cmd_reaper },
+	{ "loadctl",    cmd_loadctl },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -744,6 +934,8 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "cmb",	coremapbench },
+	{ "vmf",	vmfaulttest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
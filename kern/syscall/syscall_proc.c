@@ -13,6 +13,12 @@
 #include <vfs.h>
 #include <copyinout.h>
 #include <kern/wait.h>
+#include <kern/mman.h>
+#include <kern/shm.h>
+#include <kern/stat.h>
+#include <limits.h>
+#include <vm.h>
+#include <shm.h>
 
 
 pid_t sys_getpid() {
@@ -457,6 +463,18 @@ void * sys_sbrk(intptr_t amt, int *err) {
     return ((void *) -1);
   }
 
+  // Faults in the heap have to see it either before or after
+  struct addrspace * as = curproc->p_addrspace;
+  rwlock_acquire_write(as->as_lock);
+
+  // Nor can it grow into something mmap put above it
+  if (amt > 0 && find_segment_overlap(as, old_break, new_end_range) != NULL) {
+    rwlock_release_write(as->as_lock);
+    lock_release(curproc->sbrk_lock);
+    *err = ENOMEM;
+    return ((void *) -1);
+  }
+
   seg->region_size += amt;
 
   // Pages need to be freed if the heap size is being shrunken.
@@ -465,65 +483,277 @@ void * sys_sbrk(intptr_t amt, int *err) {
   // will be page aligned too at this point so just provide the right paddr to
   // free the right page.
   if (amt < 0) {
-    struct array * out_of_bounds_pages = array_create();
+    // Only the leaves that have something mapped get looked at, and the
+    // TLB entries go before the pages do
+    pt_release_range(&as->as_pt, new_end_range, new_end_range - amt, as);
+  }
 
-    // Iterate over the page table and destroy each one
-    for (unsigned int i = 0; i < array_num(seg->page_table); i++) {
-      // Get each page and free it
-      struct page_entry * page = (struct page_entry *) array_get(seg->page_table, i);
+  rwlock_release_write(as->as_lock);
 
-      // Free all pages that have vaddrs that are greater than the new end range.
-      if (page->vpage_n >= new_end_range) {
-        // kprintf("found page to evict at i %u\n", i);
-        array_add(out_of_bounds_pages, (void *) i, NULL);
-      }
+  lock_release(curproc->sbrk_lock);
+  return ((void *) old_break);
+}
+
+struct segment_entry * find_heap_segment() {
+  KASSERT(curproc != NULL);
+
+  // Find the heap segment that is part of the segments list in the current proc
+  struct array * segs = curproc->p_addrspace->segments_list;
+  unsigned int i;
+  for (i = 0; i < array_num(segs); i++) {
+    struct segment_entry * seg = array_get(segs, i);
+    if (seg->isHeap) return seg;
+  }
+
+  return NULL;
+}
+
+
+void * sys_mmap(void * addr, size_t len, int prot, int flags, int fd,
+                off_t offset, int *err) {
+  KASSERT(curproc != NULL);
+
+  bool shared = (flags & MAP_SHARED) != 0;
+  bool fixed = (flags & MAP_FIXED) != 0;
+
+  // Exactly one of MAP_SHARED and MAP_PRIVATE, and nothing we don't know
+  if (len == 0 || shared == ((flags & MAP_PRIVATE) != 0) ||
+      (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0 ||
+      (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+    *err = EINVAL;
+    return ((void *) -1);
+  }
+
+  // Mappings are made of whole pages
+  if (offset < 0 || offset % PAGE_SIZE != 0 ||
+      (fixed && (vaddr_t) addr % PAGE_SIZE != 0)) {
+    *err = EINVAL;
+    return ((void *) -1);
+  }
+  if (len > USERSPACETOP) {
+    *err = ENOMEM;
+    return ((void *) -1);
+  }
+  len = ROUNDUP(len, PAGE_SIZE);
+
+  struct vnode * v = NULL;
+  size_t filesize = 0;
+
+  if (flags & MAP_ANON) {
+    // Each process would get its own copy after fork anyway, so there is
+    // nothing to share (shmget is for that)
+    if (shared) {
+      *err = ENOTSUP;
+      return ((void *) -1);
+    }
+  } else {
+    if (fd < 0 || fd >= OPEN_MAX || curproc->f_table[fd] == NULL) {
+      *err = EBADF;
+      return ((void *) -1);
+    }
+
+    // The file has to be readable, and writeable too if writes to the
+    // mapping go back to it
+    int mode = curproc->f_table[fd]->fh_perms & O_ACCMODE;
+    if (mode == O_WRONLY ||
+        (shared && (prot & PROT_WRITE) && mode != O_RDWR)) {
+      *err = EACCES;
+      return ((void *) -1);
     }
 
-    for (unsigned int i = array_num(out_of_bounds_pages); i > 0 ; i--) {
-      unsigned int page_i = (unsigned int) array_get(out_of_bounds_pages, i - 1);
-      // kprintf("for i %u -> page_i %u\n", i, page_i);
+    v = curproc->f_table[fd]->fh_vnode;
 
-      struct page_entry * page = (struct page_entry *) array_get(seg->page_table, page_i);
+    // Devices can't be paged in and out
+    int result = VOP_MMAP(v);
+    if (result) {
+      *err = result;
+      return ((void *) -1);
+    }
 
-      // kprintf("freeing paddr %x, ", page->ppage_n);
-      // kprintf("freeing vaddr %x\n", page->vpage_n);
-      freeppage(page->ppage_n);
-      lock_destroy(page->swap_lock);
-      kfree(page);
-      array_remove(seg->page_table, page_i);
+    // Pages past the end of the file are zero-fill
+    struct stat st;
+    result = VOP_STAT(v, &st);
+    if (result) {
+      *err = result;
+      return ((void *) -1);
     }
+    if (st.st_size > offset) {
+      filesize = st.st_size - offset < (off_t) len ?
+                 st.st_size - offset : len;
+    }
+  }
+
+  vaddr_t vaddr = (vaddr_t) addr;
+  int result = as_mmap(curproc->p_addrspace, &vaddr, len,
+                       (prot & PROT_READ) != 0, (prot & PROT_WRITE) != 0,
+                       (prot & PROT_EXEC) != 0, shared, fixed, v, offset,
+                       filesize);
+  if (result) {
+    *err = result;
+    return ((void *) -1);
+  }
+
+  return ((void *) vaddr);
+}
+
+int sys_munmap(void * addr, size_t len, int *err) {
+  KASSERT(curproc != NULL);
+
+  vaddr_t vaddr = (vaddr_t) addr;
+  if (len == 0 || vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+      len > USERSPACETOP - vaddr) {
+    *err = EINVAL;
+    return -1;
+  }
+
+  int result = as_munmap(curproc->p_addrspace, vaddr,
+                         ROUNDUP(len, PAGE_SIZE));
+  if (result) {
+    *err = result;
+    return -1;
+  }
+
+  return 0;
+}
 
-    // Clean up the data structure after.
-    array_setsize(out_of_bounds_pages, 0);
-    array_destroy(out_of_bounds_pages);
+int sys_madvise(void * addr, size_t len, int advice, int *err) {
+  KASSERT(curproc != NULL);
+
+  vaddr_t vaddr = (vaddr_t) addr;
+  if (vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+      len > USERSPACETOP - vaddr ||
+      advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+    *err = EINVAL;
+    return -1;
+  }
 
-    // Remove invalid TLB entries
-    // TODO: Only remove the invalid ones
-    /* Disable interrupts on this CPU while frobbing the TLB. */
-    int spl = splhigh();
+  if (len == 0) {
+    return 0;
+  }
+
+  int result = vm_madvise(curproc->p_addrspace, vaddr,
+                          ROUNDUP(len, PAGE_SIZE), advice);
+  if (result) {
+    *err = result;
+    return -1;
+  }
 
-         /* Invalidate everything in the TLB */
-    for (unsigned int i=0; i<NUM_TLB; i++) {
-      tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+  return 0;
+}
+
+// Pages mincore looks at between copyouts
+#define MINCORE_CHUNK 64
+
+int sys_mincore(void * addr, size_t len, char * vec, int *err) {
+  KASSERT(curproc != NULL);
+
+  vaddr_t vaddr = (vaddr_t) addr;
+  if (vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+      len > USERSPACETOP - vaddr) {
+    *err = EINVAL;
+    return -1;
+  }
+
+  // Copying out can fault, which takes the address space lock, so each
+  // chunk is looked at first and copied out after
+  char chunk[MINCORE_CHUNK];
+  unsigned int npages = DIVROUNDUP(len, PAGE_SIZE);
+  for (unsigned int i = 0; i < npages; i += MINCORE_CHUNK) {
+    unsigned int n = npages - i < MINCORE_CHUNK ? npages - i : MINCORE_CHUNK;
+
+    int result = vm_mincore(curproc->p_addrspace, vaddr + i * PAGE_SIZE, n,
+                            chunk);
+    if (!result) {
+      result = copyout(chunk, (userptr_t) (vec + i), n);
+    }
+    if (result) {
+      *err = result;
+      return -1;
     }
+  }
+
+  return 0;
+}
+
+int sys_shmget(int key, size_t size, int flags, int *err) {
+  if (flags & ~(IPC_CREAT | IPC_EXCL)) {
+    *err = EINVAL;
+    return -1;
+  }
 
-    splx(spl);
+  int id;
+  int result = shm_get(key, size, flags, &id);
+  if (result) {
+    *err = result;
+    return -1;
   }
 
-  lock_release(curproc->sbrk_lock);
-  return ((void *) old_break);
+  return id;
 }
 
-struct segment_entry * find_heap_segment() {
+void * sys_shmat(int id, void * addr, int flags, int *err) {
   KASSERT(curproc != NULL);
 
-  // Find the heap segment that is part of the segments list in the current proc
-  struct array * segs = curproc->p_addrspace->segments_list;
-  unsigned int i;
-  for (i = 0; i < array_num(segs); i++) {
-    struct segment_entry * seg = array_get(segs, i);
-    if (seg->isHeap) return seg;
+  vaddr_t vaddr = (vaddr_t) addr;
+  if ((flags & ~SHM_RDONLY) != 0 || vaddr % PAGE_SIZE != 0) {
+    *err = EINVAL;
+    return ((void *) -1);
   }
 
-  return NULL;
+  struct shm_segment * shm = shm_attach(id);
+  if (shm == NULL) {
+    *err = EINVAL;
+    return ((void *) -1);
+  }
+
+  // A null address means anywhere there is room
+  int result = as_shmat(curproc->p_addrspace, &vaddr, shm,
+                        (flags & SHM_RDONLY) != 0, vaddr != 0);
+  if (result) {
+    *err = result;
+    return ((void *) -1);
+  }
+
+  return ((void *) vaddr);
+}
+
+int sys_shmdt(void * addr, int *err) {
+  KASSERT(curproc != NULL);
+
+  int result = as_shmdt(curproc->p_addrspace, (vaddr_t) addr);
+  if (result) {
+    *err = result;
+    return -1;
+  }
+
+  return 0;
+}
+
+int sys_shmctl(int id, int cmd, struct shmid_ds * buf, int *err) {
+  int result;
+  struct shmid_ds ds;
+
+  switch (cmd) {
+    case IPC_RMID:
+      result = shm_remove(id);
+      break;
+
+    case IPC_STAT:
+      result = shm_stat(id, &ds);
+      if (!result) {
+        result = copyout(&ds, (userptr_t) buf, sizeof(struct shmid_ds));
+      }
+      break;
+
+    default:
+      result = EINVAL;
+      break;
+  }
+
+  if (result) {
+    *err = result;
+    return -1;
+  }
+
+  return 0;
 }
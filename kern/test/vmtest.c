@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for the VM system.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// cmb
+
+/*
+ * Coremap allocation benchmark.
+ *
+ * Runs NTHREADS kernel threads at once, each of which allocates and
+ * frees physical pages through alloc_kpages/free_kpages CMB_ROUNDS
+ * times. Each thread keeps CMB_WINDOW allocations outstanding so the
+ * allocator sees a partly fragmented coremap rather than the same page
+ * over and over, and every CMB_MULTI_EVERY-th allocation asks for
+ * CMB_MULTI_PAGES contiguous pages. The total allocation rate is
+ * printed at the end.
+ *
+ * The defaults match the 32-CPU sys161 configuration; both can be
+ * changed from the menu: cmb [threads] [rounds]
+ */
+
+#define CMB_THREADS      32
+#define CMB_ROUNDS       2000
+#define CMB_WINDOW       16
+#define CMB_MULTI_EVERY  8
+#define CMB_MULTI_PAGES  4
+
+static struct semaphore *cmb_sem;
+static volatile unsigned cmb_failures;
+
+static
+void
+cmbthread(void *junk, unsigned long rounds)
+{
+	vaddr_t window[CMB_WINDOW];
+	unsigned long i;
+	unsigned slot, npages;
+
+	(void)junk;
+
+	for (slot=0; slot<CMB_WINDOW; slot++) {
+		window[slot] = 0;
+	}
+
+	for (i=0; i<rounds; i++) {
+		slot = i % CMB_WINDOW;
+		if (window[slot] != 0) {
+			free_kpages(window[slot]);
+			window[slot] = 0;
+		}
+
+		npages = (i % CMB_MULTI_EVERY) == 0 ? CMB_MULTI_PAGES : 1;
+		window[slot] = alloc_kpages(npages);
+		if (window[slot] == 0) {
+			cmb_failures++;
+			continue;
+		}
+
+		/* Touch the first word so the page is really ours */
+		*(volatile uint32_t *)window[slot] = i;
+	}
+
+	for (slot=0; slot<CMB_WINDOW; slot++) {
+		if (window[slot] != 0) {
+			free_kpages(window[slot]);
+		}
+	}
+
+	V(cmb_sem);
+}
+
+int
+coremapbench(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned nthreads = CMB_THREADS;
+	unsigned long rounds = CMB_ROUNDS;
+	unsigned i, used_before, used_after;
+	uint64_t nsecs, total, rate;
+	int result;
+
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		rounds = atoi(args[2]);
+	}
+	if (nargs > 3 || nthreads == 0 || rounds == 0) {
+		kprintf("Usage: cmb [threads] [rounds]\n");
+		return EINVAL;
+	}
+
+	cmb_sem = sem_create("cmb", 0);
+	if (cmb_sem == NULL) {
+		panic("cmb: sem_create failed\n");
+	}
+	cmb_failures = 0;
+
+	kprintf("Starting coremap benchmark: %u threads, %lu rounds each\n",
+		nthreads, rounds);
+
+	used_before = coremap_used_bytes();
+	gettime(&before);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("cmb", NULL, cmbthread, NULL, rounds);
+		if (result) {
+			panic("cmb: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(cmb_sem);
+	}
+
+	gettime(&after);
+	used_after = coremap_used_bytes();
+	sem_destroy(cmb_sem);
+
+	timespec_sub(&after, &before, &duration);
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	total = (uint64_t)nthreads * rounds;
+	rate = nsecs == 0 ? 0 : total * 1000000000ULL / nsecs;
+
+	kprintf("cmb: %llu allocations in %llu.%09lu seconds "
+		"(%llu allocations/sec, %u failed)\n",
+		(unsigned long long)total,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec,
+		(unsigned long long)rate, cmb_failures);
+
+	if (used_after != used_before) {
+		kprintf("cmb: coremap usage changed from %u to %u bytes\n",
+			used_before, used_after);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vmf
+
+/*
+ * Concurrent page fault stress test.
+ *
+ * Runs NTHREADS kernel threads in one process with a fresh address
+ * space, all faulting on the same VMF_PAGES pages of anonymous memory
+ * at once. Every thread owns one word in each page. Each round, a
+ * thread walks all the pages starting at a different offset from the
+ * other threads, checks that its word still holds what it wrote in the
+ * previous round, and writes a new value. The first read of a page
+ * maps the zero page and the first write replaces it, so this covers
+ * both faults that add pages and faults that need the address space to
+ * themselves.
+ *
+ * There are no user-level threads yet, so the threads fault through
+ * copyin/copyout. Usage: vmf [threads]
+ */
+
+#define VMF_THREADS	8
+#define VMF_ROUNDS	8
+#define VMF_PAGES	64
+#define VMF_BASE	0x10000000
+
+#define VMF_VALUE(page, thread, round) \
+	(((uint32_t)(page) << 20) | ((uint32_t)(thread) << 8) | (round))
+
+static struct semaphore *vmf_sem;
+static struct proc *vmf_proc;
+static unsigned vmf_nthreads;
+static volatile unsigned vmf_failures;
+
+static
+void
+vmfthread(void *junk, unsigned long num)
+{
+	unsigned long round, i, page;
+	uint32_t val, expected;
+	userptr_t addr;
+	bool failed = false;
+
+	(void)junk;
+
+	as_activate();
+
+	for (round=0; round<=VMF_ROUNDS && !failed; round++) {
+		for (i=0; i<VMF_PAGES; i++) {
+			page = (i + num * VMF_PAGES / vmf_nthreads)
+				% VMF_PAGES;
+			addr = (userptr_t)(VMF_BASE + page * PAGE_SIZE
+					   + num * sizeof(uint32_t));
+
+			expected = round == 0 ? 0 :
+				VMF_VALUE(page, num, round - 1);
+			if (copyin(addr, &val, sizeof(val)) ||
+			    val != expected) {
+				kprintf("vmf: thread %lu page %lu: "
+					"read 0x%x, expected 0x%x\n",
+					num, page, val, expected);
+				failed = true;
+				break;
+			}
+
+			/* The last round only checks */
+			if (round == VMF_ROUNDS) {
+				continue;
+			}
+
+			val = VMF_VALUE(page, num, round);
+			if (copyout(&val, addr, sizeof(val))) {
+				kprintf("vmf: thread %lu page %lu: "
+					"write failed\n", num, page);
+				failed = true;
+				break;
+			}
+		}
+	}
+
+	if (failed) {
+		vmf_failures++;
+	}
+
+	/* Move back to the kernel so the test can destroy our process */
+	proc_remthread(curthread);
+	proc_addthread(kproc, curthread);
+
+	V(vmf_sem);
+}
+
+int
+vmfaulttest(int nargs, char **args)
+{
+	struct addrspace *as;
+	unsigned i;
+	int result;
+
+	vmf_nthreads = VMF_THREADS;
+	if (nargs > 1) {
+		vmf_nthreads = atoi(args[1]);
+	}
+	if (nargs > 2 || vmf_nthreads == 0 ||
+	    vmf_nthreads > PAGE_SIZE / sizeof(uint32_t)) {
+		kprintf("Usage: vmf [threads]\n");
+		return EINVAL;
+	}
+
+	vmf_proc = proc_create_runprogram("vmf");
+	if (vmf_proc == NULL) {
+		return ENOMEM;
+	}
+
+	as = as_create(false);
+	if (as == NULL) {
+		proc_destroy(vmf_proc);
+		return ENOMEM;
+	}
+	vmf_proc->p_addrspace = as;
+
+	result = as_define_region(as, VMF_BASE, VMF_PAGES * PAGE_SIZE,
+				  1, 1, 0);
+	if (result) {
+		proc_destroy(vmf_proc);
+		return result;
+	}
+
+	vmf_sem = sem_create("vmf", 0);
+	if (vmf_sem == NULL) {
+		panic("vmf: sem_create failed\n");
+	}
+	vmf_failures = 0;
+
+	kprintf("Starting VM fault test: %u threads, %u pages, "
+		"%u rounds\n", vmf_nthreads, VMF_PAGES, VMF_ROUNDS);
+
+	for (i=0; i<vmf_nthreads; i++) {
+		result = thread_fork("vmf", vmf_proc, vmfthread, NULL, i);
+		if (result) {
+			panic("vmf: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<vmf_nthreads; i++) {
+		P(vmf_sem);
+	}
+
+	sem_destroy(vmf_sem);
+	proc_destroy(vmf_proc);
+
+	if (vmf_failures > 0) {
+		kprintf("vmf: %u threads failed\n", vmf_failures);
+		return EINVAL;
+	}
+
+	kprintf("vmf: passed\n");
+	return 0;
+}
@@ -1167,32 +1167,50 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	unsigned n;
 
+	/*
+	 * Shootdowns are only sent with interrupts on, so while we
+	 * wait here for a full queue to drain, this CPU keeps taking
+	 * its own shootdowns and can't hold up a target that is
+	 * waiting on us in turn.
+	 */
+	KASSERT(curthread->t_curspl == 0);
+
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	while (target->c_numshootdown == TLBSHOOTDOWN_MAX) {
+		spinlock_release(&target->c_ipi_lock);
+		thread_yield();
+		spinlock_acquire(&target->c_ipi_lock);
 	}
 
+	n = target->c_numshootdown;
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
+
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to each CPU whose bit is set in CPUS. The
+ * caller takes care of the current CPU itself and leaves it out.
+ */
+void
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (cpus & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <spl.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <linkedlist.h>
 #include <addrspace.h>
@@ -38,6 +39,18 @@
 #include <array.h>
 #include <current.h>
 #include <bitmap.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <vnode.h>
+#include <swapmap.h>
+#include <synch.h>
+#include <shm.h>
+
+struct page_entry ** * utlb_pagedirs[MAXCPUS];
+
+// Handed out to address spaces in turn (see swapmap.h). Wrapping around
+// just means two address spaces might share clusters.
+static uint16_t next_swap_hint = 1;
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -61,6 +74,43 @@ as_create(bool createHeap) {
     return NULL;
   }
 
+  as->as_lock = rwlock_create("addrspace");
+  as->as_ptlock = lock_create("addrspace pt");
+  if (as->as_lock == NULL || as->as_ptlock == NULL) {
+    if (as->as_lock != NULL) {
+      rwlock_destroy(as->as_lock);
+    }
+    if (as->as_ptlock != NULL) {
+      lock_destroy(as->as_ptlock);
+    }
+    array_destroy(as->segments_list);
+    kfree(as);
+    return NULL;
+  }
+
+  pt_init(&as->as_pt);
+
+  // No ASID until it first runs somewhere
+  for (unsigned int i = 0; i < MAXCPUS; i++) {
+    as->as_asids[i] = 0;
+    as->as_asid_gens[i] = 0;
+  }
+  as->as_cpus = 0;
+
+  // Only a hint, so racing with another as_create doesn't matter
+  as->as_swap_hint = next_swap_hint++;
+
+  as->as_fa_window = 0;
+  as->as_fa_cooldown = 0;
+  as->as_fa_prefetched = 0;
+  as->as_fa_wasted = 0;
+
+  as->as_lc_period = 0;
+  as->as_lc_faults = 0;
+  as->as_lc_since = 0;
+  as->as_lc_suspended = false;
+  as->as_lc_next = NULL;
+
   // If we don't have to create a heap (used in as_copy)
   if (!createHeap) {
     return as;
@@ -72,6 +122,10 @@ as_create(bool createHeap) {
   //kprintf("HEAP: 0x%x --> 0x%x\n", USERHEAPSTART, USERHEAPSTART + 0);
 
   heap_segment->isHeap = true;
+  heap_segment->isMmap = false;
+  heap_segment->isShared = false;
+  heap_segment->shm = NULL;
+  heap_segment->advice = MADV_NORMAL;
 
   // The address the heap starts at
   heap_segment->region_start = USERHEAPSTART;
@@ -83,12 +137,7 @@ as_create(bool createHeap) {
   heap_segment->readable = 1;
   heap_segment->writeable = 1;
   heap_segment->executable = 0;
-
-  heap_segment->page_table = array_create();
-  if (heap_segment->page_table == NULL) {
-    as_destroy(as);
-    return NULL;
-  }
+  heap_segment->file_vnode = NULL;
 
   array_add(as->segments_list, heap_segment, NULL);
 
@@ -112,8 +161,11 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 
   struct segment_entry * old_seg;
   struct segment_entry * new_seg;
-  struct page_entry * old_page;
-  struct page_entry * new_page;
+
+  // Sharing a page makes it read-only, which a fault that saw it as
+  // private could miss, so keep old's faults out until we're done
+  rwlock_acquire_write(old->as_lock);
+
   unsigned int size = array_num(old->segments_list);
 
         // Go through and copy segments
@@ -125,6 +177,7 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
     // Create the new segment
     new_seg = (struct segment_entry *) kmalloc(sizeof(struct segment_entry));
     if (new_seg == NULL) {
+      rwlock_release_write(old->as_lock);
       as_destroy(newas);
       return ENOMEM;
     }
@@ -136,6 +189,20 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
     new_seg->readable = old_seg->readable;
     new_seg->executable = old_seg->executable;
     new_seg->isHeap = old_seg->isHeap;
+    new_seg->isMmap = old_seg->isMmap;
+    new_seg->isShared = old_seg->isShared;
+    new_seg->shm = old_seg->shm;
+    new_seg->advice = old_seg->advice;
+
+    new_seg->file_vnode = old_seg->file_vnode;
+    new_seg->file_offset = old_seg->file_offset;
+    new_seg->file_size = old_seg->file_size;
+    if (new_seg->file_vnode != NULL) {
+      VOP_INCREF(new_seg->file_vnode);
+    }
+    if (new_seg->shm != NULL) {
+      shm_ref(new_seg->shm);
+    }
 
     //kprintf("COPY ");
     //if (new_seg->executable) {kprintf("CODE/TEXT: Executable, ");}
@@ -143,55 +210,23 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
     //if (new_seg->readable) {kprintf("Readable, ");}
     //kprintf("0x%x --> 0x%x\n", new_seg->region_start, new_seg->region_start + new_seg->region_size);
 
-    unsigned int pt_size = array_num(old_seg->page_table);
-    new_seg->page_table = array_create();
-    if (new_seg->page_table == NULL) {
-      as_destroy(newas);
-      return ENOMEM;
-    }
-
-
-    // Copy the page table
-    for (unsigned int j=0; j < pt_size; j++) {
-      // Create a new page
-      old_page = array_get(old_seg->page_table, j);
-      new_page = kmalloc(sizeof(struct page_entry));
-      if (new_page == NULL) {
-        segment_destroy(new_seg);
-        as_destroy(newas);
-        return ENOMEM;
-      }
-
-      // Copy over the virtual page info
-      new_page->vpage_n = old_page->vpage_n;
-      if (new_seg->writeable) { new_page->state = DIRTY; }
-
-      // get a new physical page
-      new_page->ppage_n = getppages(1, false);
-
-      if (new_page->ppage_n == 0) {
-        kfree(new_page);
-        segment_destroy(new_seg);
-        as_destroy(newas);
-        return ENOMEM;
-      }
+    array_add(newas->segments_list, new_seg, NULL);
 
-      new_page->swap_lock = lock_create("swap_lock");
-      KASSERT(new_page->swap_lock != NULL);
+  }
 
-      if (old_page->swap_state == DISK) {
-        block_read(old_page->bitmap_disk_index, new_page->ppage_n);
-      } else {
-        memmove((void *)PADDR_TO_KVADDR(new_page->ppage_n),
-              (const void *)PADDR_TO_KVADDR(old_page->ppage_n), PAGE_SIZE);
-      }
+  // Share the pages copy-on-write
+  int result = pt_share(&newas->as_pt, &old->as_pt);
+  if (result) {
+    rwlock_release_write(old->as_lock);
+    as_destroy(newas);
+    return result;
+  }
 
-      array_add(new_seg->page_table, new_page, NULL);
-    }
+  // The parent may still have writeable TLB entries for pages that are
+  // shared now, so drop them.
+  vm_tlb_invalidate_range(old, 0, USERSPACETOP);
 
-    array_add(newas->segments_list, new_seg, NULL);
-
-  }
+  rwlock_release_write(old->as_lock);
 
   *ret = newas;
   return 0;
@@ -215,21 +250,22 @@ as_activate(void)
    /* Disable interrupts on this CPU while frobbing the TLB. */
    int spl = splhigh();
 
-        /* Invalidate everything in the TLB */
-   for (unsigned int i=0; i<NUM_TLB; i++) {
-     tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-   }
+   // Our TLB entries are tagged with our ASID, so there's no need to
+   // throw out everybody else's
+   vm_tlb_activate(as);
+
+   // Point the refill handler at our page table
+   utlb_pagedirs[curcpu->c_number] = as->as_pt.pt_leaves;
 
    splx(spl);
 }
 
 void as_deactivate(void)
 {
-  /*
-   * Write this. For many designs it won't need to actually do
-   * anything. See proc.c for an explanation of why it (might)
-   * be needed.
-   */
+  // Keep the refill handler away from a page table that is about to go
+  int spl = splhigh();
+  utlb_pagedirs[curcpu->c_number] = NULL;
+  splx(spl);
 }
 
 /*
@@ -251,13 +287,25 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
   //if (readable) {kprintf("Readable, ");}
   //kprintf("0x%x --> 0x%x\n", vaddr, vaddr + memsize);
 
+  // User programs don't get to map kernel memory
+  if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+    return EFAULT;
+  }
+
+  rwlock_acquire_write(as->as_lock);
+
   // Check if there will be overlap
-  if (find_segment_from_vaddr(vaddr) != NULL) {
+  if (find_segment(as, vaddr) != NULL) {
+    rwlock_release_write(as->as_lock);
     return EINVAL;
   }
 
   // Create the actual segment itself
   struct segment_entry * segment = kmalloc(sizeof(struct segment_entry));
+  if (segment == NULL) {
+    rwlock_release_write(as->as_lock);
+    return ENOMEM;
+  }
 
   // Set the start and bounds for the segment
   segment->region_start = vaddr;
@@ -267,19 +315,178 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
   segment->readable = readable;
   segment->writeable = writeable;
   segment->executable = executable;
+  segment->isHeap = false;
+  segment->isMmap = false;
+  segment->isShared = false;
+  segment->shm = NULL;
+  segment->advice = MADV_NORMAL;
+
+  // Zero-fill until as_map_file says otherwise
+  segment->file_vnode = NULL;
+  segment->file_offset = 0;
+  segment->file_size = 0;
+
+  // Add it to the array. The address space belongs to the caller, who
+  // cleans it up on failure.
+  int result = array_add(as->segments_list, (void *) segment, NULL);
+  rwlock_release_write(as->as_lock);
+  if (result) {
+    segment_destroy(segment);
+    return result;
+  }
 
-  // Initialize the page table
-  segment->page_table = array_create();
-  if (segment->page_table == NULL) {
-    kfree(as);
-    return ENOMEM;
+  return 0;
+}
+
+
+/*
+ * Back the first FILESIZE bytes of the region starting at VADDR with the
+ * file V from OFFSET on. Nothing is read yet; vm_fault reads each page in
+ * the first time it is touched, and the rest of the region is zero-fill.
+ */
+int as_map_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+                off_t offset, size_t filesize)
+{
+  struct segment_entry * segment = NULL;
+
+  rwlock_acquire_write(as->as_lock);
+
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->region_start == vaddr) {
+      segment = seg;
+      break;
+    }
+  }
+
+  if (segment == NULL || segment->file_vnode != NULL ||
+      filesize > segment->region_size) {
+    rwlock_release_write(as->as_lock);
+    return EINVAL;
+  }
+
+  // The region keeps the file open for as long as it exists
+  VOP_INCREF(v);
+  segment->file_vnode = v;
+  segment->file_offset = offset;
+  segment->file_size = filesize;
+
+  rwlock_release_write(as->as_lock);
+  return 0;
+}
+
+
+/*
+ * Find the highest LEN bytes under USERMMAPTOP that no segment is using,
+ * staying above the heap so that it has room to grow. Called with
+ * as->as_lock held.
+ */
+static int as_find_gap(struct addrspace *as, size_t len, vaddr_t *ret)
+{
+  vaddr_t floor = USERHEAPSTART;
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->isHeap) {
+      floor = seg->region_start + seg->region_size;
+    }
   }
 
-  // Add it to the array
+  // Move down past whatever is in the way until the gap is big enough
+  vaddr_t end = USERMMAPTOP;
+  while (end >= floor && end - floor >= len) {
+    struct segment_entry * seg = find_segment_overlap(as, end - len, end);
+    if (seg == NULL) {
+      *ret = end - len;
+      return 0;
+    }
+    end = seg->region_start & PAGE_FRAME;
+  }
+
+  return ENOMEM;
+}
+
+
+/*
+ * Place SEGMENT, whose region_size is set, at *VADDR if FIXED is set and in
+ * the highest free spot under the stack otherwise, and add it to the address
+ * space. Hands back where it went in *VADDR. On failure the segment is left
+ * to the caller.
+ */
+static int as_add_segment(struct addrspace *as, struct segment_entry *segment,
+                          vaddr_t *vaddr, bool fixed)
+{
+  size_t len = segment->region_size;
+  KASSERT(len > 0 && len % PAGE_SIZE == 0);
+
+  rwlock_acquire_write(as->as_lock);
+
+  vaddr_t start = *vaddr;
+  if (fixed) {
+    // Replacing existing mappings isn't supported, so it has to be free
+    if (start == 0 || start >= USERSPACETOP ||
+        len > USERSPACETOP - start ||
+        find_segment_overlap(as, start, start + len) != NULL) {
+      rwlock_release_write(as->as_lock);
+      return EINVAL;
+    }
+  } else {
+    int result = as_find_gap(as, len, &start);
+    if (result) {
+      rwlock_release_write(as->as_lock);
+      return result;
+    }
+  }
+
+  segment->region_start = start;
+
   int result = array_add(as->segments_list, (void *) segment, NULL);
+  rwlock_release_write(as->as_lock);
+  if (result) {
+    return result;
+  }
+
+  *vaddr = start;
+  return 0;
+}
+
+
+/*
+ * Add a region of LEN bytes for mmap (see as_add_segment for where it
+ * goes). If V is given, the first FILESIZE bytes of it come from the file
+ * from OFFSET on, the same as with as_map_file.
+ */
+int as_mmap(struct addrspace *as, vaddr_t *vaddr, size_t len,
+            int readable, int writeable, int executable, bool shared,
+            bool fixed, struct vnode *v, off_t offset, size_t filesize)
+{
+  KASSERT(filesize <= len);
+
+  struct segment_entry * segment = kmalloc(sizeof(struct segment_entry));
+  if (segment == NULL) {
+    return ENOMEM;
+  }
+
+  segment->region_size = len;
+  segment->readable = readable;
+  segment->writeable = writeable;
+  segment->executable = executable;
+  segment->isHeap = false;
+  segment->isMmap = true;
+  segment->isShared = shared;
+  segment->shm = NULL;
+  segment->advice = MADV_NORMAL;
+
+  // The region keeps the file open for as long as it exists
+  segment->file_vnode = v;
+  segment->file_offset = offset;
+  segment->file_size = filesize;
+  if (v != NULL) {
+    VOP_INCREF(v);
+  }
+
+  int result = as_add_segment(as, segment, vaddr, fixed);
   if (result) {
     segment_destroy(segment);
-    as_destroy(as);
     return result;
   }
 
@@ -287,6 +494,183 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 }
 
 
+/*
+ * Attach the shared memory segment SHM (see as_add_segment for where it
+ * goes), read-only if READONLY is set. The reference to SHM the caller got
+ * from shm_attach becomes the attachment's, and is dropped if attaching
+ * fails.
+ */
+int as_shmat(struct addrspace *as, vaddr_t *vaddr, struct shm_segment *shm,
+             bool readonly, bool fixed)
+{
+  struct segment_entry * segment = kmalloc(sizeof(struct segment_entry));
+  if (segment == NULL) {
+    shm_detach(shm);
+    return ENOMEM;
+  }
+
+  segment->region_size = shm_size(shm);
+  segment->readable = 1;
+  segment->writeable = !readonly;
+  segment->executable = 0;
+  segment->isHeap = false;
+  segment->isMmap = false;
+  segment->isShared = true;
+  segment->shm = shm;
+  segment->advice = MADV_NORMAL;
+
+  // The pages come from the segment, never a file
+  segment->file_vnode = NULL;
+  segment->file_offset = 0;
+  segment->file_size = 0;
+
+  int result = as_add_segment(as, segment, vaddr, fixed);
+  if (result) {
+    segment_destroy(segment);
+    return result;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Detach the shared memory segment attached at VADDR. Fails with EINVAL if
+ * there isn't one there.
+ */
+int as_shmdt(struct addrspace *as, vaddr_t vaddr)
+{
+  struct segment_entry * segment = NULL;
+
+  rwlock_acquire_write(as->as_lock);
+
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->region_start == vaddr && seg->shm != NULL) {
+      array_remove(as->segments_list, i);
+      segment = seg;
+      break;
+    }
+  }
+
+  if (segment == NULL) {
+    rwlock_release_write(as->as_lock);
+    return EINVAL;
+  }
+
+  // The segment keeps its own reference to every page, so they stay
+  vaddr_t end = vaddr + segment->region_size;
+  pt_release_range(&as->as_pt, vaddr, end, as);
+
+  rwlock_release_write(as->as_lock);
+
+  // This may be the last attachment of a removed segment, which frees it
+  segment_destroy(segment);
+  return 0;
+}
+
+
+/* Cut a segment's front off so that it starts at START */
+static void segment_trim_front(struct segment_entry *seg, vaddr_t start)
+{
+  size_t cut = start - seg->region_start;
+
+  seg->region_start = start;
+  seg->region_size -= cut;
+
+  // Whatever is left of the file part starts further into the file
+  seg->file_offset += cut;
+  seg->file_size = seg->file_size > cut ? seg->file_size - cut : 0;
+}
+
+/* Cut a segment's back off so that it ends at END */
+static void segment_trim_back(struct segment_entry *seg, vaddr_t end)
+{
+  seg->region_size = end - seg->region_start;
+  if (seg->file_size > seg->region_size) {
+    seg->file_size = seg->region_size;
+  }
+}
+
+
+/*
+ * Remove the pages in [VADDR, VADDR + LEN), which has to be page aligned,
+ * from the mmap'd regions they are in. Regions partly in the range get
+ * shrunk, or split in two if the range is in the middle of one. Fails with
+ * EINVAL, without changing anything, if the range covers anything mmap
+ * didn't make.
+ */
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+  vaddr_t end = vaddr + len;
+  KASSERT(vaddr % PAGE_SIZE == 0 && len % PAGE_SIZE == 0 && end > vaddr);
+
+  // A split needs another segment, so get one before changing anything
+  struct segment_entry * split = kmalloc(sizeof(struct segment_entry));
+  if (split == NULL) {
+    return ENOMEM;
+  }
+
+  rwlock_acquire_write(as->as_lock);
+
+  unsigned int num = array_num(as->segments_list);
+  for (unsigned int i = 0; i < num; i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->region_start < end &&
+        seg->region_start + seg->region_size > vaddr && !seg->isMmap) {
+      rwlock_release_write(as->as_lock);
+      kfree(split);
+      return EINVAL;
+    }
+  }
+
+  // Go backwards so that removing a segment doesn't skip the next one
+  for (unsigned int i = num; i-- > 0; ) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    vaddr_t seg_end = seg->region_start + seg->region_size;
+    if (seg->region_start >= end || seg_end <= vaddr) {
+      continue;
+    }
+
+    if (vaddr <= seg->region_start && end >= seg_end) {
+      // All of it goes
+      array_remove(as->segments_list, i);
+      segment_destroy(seg);
+    } else if (vaddr <= seg->region_start) {
+      segment_trim_front(seg, end);
+    } else if (end >= seg_end) {
+      segment_trim_back(seg, vaddr);
+    } else {
+      // A hole in the middle, so nothing else is in the range. The part
+      // after the hole becomes a region of its own.
+      *split = *seg;
+      int result = array_add(as->segments_list, (void *) split, NULL);
+      if (result) {
+        rwlock_release_write(as->as_lock);
+        kfree(split);
+        return result;
+      }
+      if (split->file_vnode != NULL) {
+        VOP_INCREF(split->file_vnode);
+      }
+      segment_trim_front(split, end);
+      segment_trim_back(seg, vaddr);
+      split = NULL;
+    }
+  }
+
+  // Only the leaves that have something mapped get looked at. Dirty pages
+  // of shared mappings go back to their file when their last mapping does.
+  // The TLB entries go before the pages do.
+  pt_release_range(&as->as_pt, vaddr, end, as);
+
+  rwlock_release_write(as->as_lock);
+
+  kfree(split);
+  return 0;
+}
+
+
 int as_prepare_load(struct addrspace *as)
 {
   /*
@@ -352,39 +736,45 @@ void as_destroy(struct addrspace *as)
   array_setsize(as->segments_list, 0);
   array_destroy(as->segments_list);
 
+  // A CPU that switched to a kernel thread after running us could still
+  // have our page table loaded
+  for (unsigned int i = 0; i < MAXCPUS; i++) {
+    if (utlb_pagedirs[i] == as->as_pt.pt_leaves) {
+      utlb_pagedirs[i] = NULL;
+    }
+  }
+
+  // The pages go now or in the background, depending on how many there are
+  vm_reap(as);
+}
+
+/* Free the pages and whatever else is left of an address space */
+void as_reap(struct addrspace *as)
+{
+  // Drop every page that is mapped. Nothing runs in the address space
+  // any more, so there is nothing to shoot down.
+  pt_release_range(&as->as_pt, 0, USERSPACETOP, NULL);
+  swapmap_close(as->as_swap_hint);
+
+  rwlock_destroy(as->as_lock);
+  lock_destroy(as->as_ptlock);
+
   // Delete the addres sspace
   kfree(as);
 }
 
 
-/* Destroy a segment and its page table */
+/* Destroy a segment */
 void segment_destroy(struct segment_entry * segment) {
 
   KASSERT(segment != NULL);
-  if (segment->page_table == NULL) {
-    kfree(segment);
-    return;
-  }
-
-  // Iterate over the page table and destroy each one
-  for (unsigned int i = 0; i < array_num(segment->page_table); i++) {
 
-    // Get each page and free it
-    struct page_entry * page = (struct page_entry *) array_get(segment->page_table, i);
-
-    // Free the page, and then free the actual structure
-    lock_destroy(page->swap_lock);
-    if (page->swap_state == MEMORY) {
-      freeppage(page->ppage_n);
-    } else {
-      bitmap_unmark(disk_bitmap, page->bitmap_disk_index);
-    }
-    kfree(page);
+  if (segment->file_vnode != NULL) {
+    VOP_DECREF(segment->file_vnode);
+  }
+  if (segment->shm != NULL) {
+    shm_detach(segment->shm);
   }
-
-  // Destroy the array
-  array_setsize(segment->page_table, 0);
-  array_destroy(segment->page_table);
 
   // Free the segment
   kfree(segment);
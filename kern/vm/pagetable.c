@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <membar.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swapmap.h>
+
+void pt_init(struct pagetable * pt) {
+  for (unsigned int i = 0; i < PT_DIR_SIZE; i++) {
+    pt->pt_leaves[i] = NULL;
+    pt->pt_counts[i] = 0;
+  }
+}
+
+struct page_entry * pt_lookup(struct pagetable * pt, vaddr_t vaddr) {
+  KASSERT(vaddr < USERSPACETOP);
+
+  struct page_entry ** leaf = pt->pt_leaves[PT_DIR_INDEX(vaddr)];
+  if (leaf == NULL) {
+    return NULL;
+  }
+
+  return leaf[PT_LEAF_INDEX(vaddr)];
+}
+
+int pt_insert(struct pagetable * pt, vaddr_t vaddr, struct page_entry * page) {
+  KASSERT(vaddr < USERSPACETOP);
+  KASSERT(page != NULL);
+
+  unsigned int dir = PT_DIR_INDEX(vaddr);
+
+  // Allocate the leaf the first time something in its range is mapped
+  if (pt->pt_leaves[dir] == NULL) {
+    struct page_entry ** leaf = kmalloc(PT_LEAF_SIZE * sizeof(struct page_entry *));
+    if (leaf == NULL) {
+      return ENOMEM;
+    }
+    for (unsigned int i = 0; i < PT_LEAF_SIZE; i++) {
+      leaf[i] = NULL;
+    }
+    // Lookups don't lock, so the leaf has to be cleared before it shows up
+    membar_store_store();
+    pt->pt_leaves[dir] = leaf;
+  }
+
+  KASSERT(pt->pt_leaves[dir][PT_LEAF_INDEX(vaddr)] == NULL);
+  pt->pt_leaves[dir][PT_LEAF_INDEX(vaddr)] = page;
+  pt->pt_counts[dir]++;
+
+  return 0;
+}
+
+void pt_replace(struct pagetable * pt, vaddr_t vaddr, struct page_entry * page) {
+  KASSERT(page != NULL);
+
+  struct page_entry ** leaf = pt->pt_leaves[PT_DIR_INDEX(vaddr)];
+  KASSERT(leaf != NULL);
+  KASSERT(leaf[PT_LEAF_INDEX(vaddr)] != NULL);
+
+  leaf[PT_LEAF_INDEX(vaddr)] = page;
+}
+
+int pt_share(struct pagetable * dst, struct pagetable * src) {
+  for (unsigned int dir = 0; dir < PT_DIR_SIZE; dir++) {
+    struct page_entry ** leaf = src->pt_leaves[dir];
+    if (leaf == NULL) {
+      continue;
+    }
+
+    KASSERT(dst->pt_leaves[dir] == NULL);
+    struct page_entry ** copy = kmalloc(PT_LEAF_SIZE * sizeof(struct page_entry *));
+    if (copy == NULL) {
+      return ENOMEM;
+    }
+
+    for (unsigned int i = 0; i < PT_LEAF_SIZE; i++) {
+      struct page_entry * page = leaf[i];
+      copy[i] = page;
+      if (page == NULL) {
+        continue;
+      }
+
+      page_share(page);
+    }
+
+    dst->pt_leaves[dir] = copy;
+    dst->pt_counts[dir] = src->pt_counts[dir];
+  }
+
+  return 0;
+}
+
+/*
+ * Pages are taken out of the page table this many at a time. Each batch is
+ * shot down before any of its pages or leaves are freed, so that no CPU can
+ * still reach them through its TLB or a refill in progress.
+ */
+#define PT_RELEASE_BATCH 32
+
+void pt_release_range(struct pagetable * pt, vaddr_t start, vaddr_t end,
+                      struct addrspace * as) {
+  KASSERT(start <= end);
+  KASSERT(end <= USERSPACETOP);
+
+  // Pages get freed in batches, which matters when a process exits
+  struct page_free_batch batch = PAGE_FREE_BATCH_INITIALIZER;
+  struct page_entry * pages[PT_RELEASE_BATCH];
+  struct page_entry ** leaves[PT_RELEASE_BATCH];
+
+  vaddr_t vaddr = start & PAGE_FRAME;
+  while (vaddr < end) {
+    vaddr_t batch_start = vaddr;
+    unsigned int npages = 0;
+    unsigned int nleaves = 0;
+
+    // First clear the entries, so faults and refills stop finding them
+    while (vaddr < end && npages < PT_RELEASE_BATCH) {
+      unsigned int dir = PT_DIR_INDEX(vaddr);
+      vaddr_t leaf_end = (dir + 1) * PT_LEAF_SPAN;
+      if (leaf_end > end) {
+        leaf_end = end;
+      }
+
+      struct page_entry ** leaf = pt->pt_leaves[dir];
+
+      // Skip over leaves with nothing in them
+      if (leaf == NULL) {
+        vaddr = (dir + 1) * PT_LEAF_SPAN;
+        continue;
+      }
+
+      for (; vaddr < leaf_end && npages < PT_RELEASE_BATCH;
+           vaddr += PAGE_SIZE) {
+        unsigned int i = PT_LEAF_INDEX(vaddr);
+        if (leaf[i] == NULL) {
+          continue;
+        }
+
+        pages[npages++] = leaf[i];
+        leaf[i] = NULL;
+        pt->pt_counts[dir]--;
+      }
+
+      if (pt->pt_counts[dir] == 0) {
+        leaves[nleaves++] = leaf;
+        pt->pt_leaves[dir] = NULL;
+      }
+
+      if (vaddr >= leaf_end) {
+        vaddr = (dir + 1) * PT_LEAF_SPAN;
+      }
+    }
+
+    if (vaddr > end) {
+      vaddr = end;
+    }
+
+    // Then drop whatever the TLBs still hold for them
+    if (as != NULL && npages > 0) {
+      vm_tlb_invalidate_range(as, batch_start, vaddr);
+    }
+
+    // Only now can the pages and leaves go
+    for (unsigned int i = 0; i < npages; i++) {
+      page_release_batch(pages[i], &batch);
+    }
+    for (unsigned int i = 0; i < nleaves; i++) {
+      kfree(leaves[i]);
+    }
+  }
+
+  page_free_batch_flush(&batch);
+}
+
+void pt_foreach(struct pagetable * pt,
+                void (*func)(vaddr_t, struct page_entry *, void *),
+                void * data) {
+  for (unsigned int dir = 0; dir < PT_DIR_SIZE; dir++) {
+    struct page_entry ** leaf = pt->pt_leaves[dir];
+    if (leaf == NULL) {
+      continue;
+    }
+
+    for (unsigned int i = 0; i < PT_LEAF_SIZE; i++) {
+      if (leaf[i] != NULL) {
+        func(dir * PT_LEAF_SPAN + i * PAGE_SIZE, leaf[i], data);
+      }
+    }
+  }
+}
+
+unsigned int pt_count(struct pagetable * pt) {
+  unsigned int count = 0;
+
+  for (unsigned int dir = 0; dir < PT_DIR_SIZE; dir++) {
+    count += pt->pt_counts[dir];
+  }
+
+  return count;
+}
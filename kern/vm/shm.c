@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory segments. See shm.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/shm.h>
+#include <lib.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <shm.h>
+
+// Most segments there can be at once. A segment's id is its slot.
+#define SHM_MAX 32
+
+struct shm_segment {
+  int shm_id;
+  int shm_key;
+  unsigned int shm_npages;
+
+  // Attachments, and whether the segment goes once there are none
+  unsigned int shm_refs;
+  bool shm_removed;
+
+  // The pages, NULL until first touched. Each holds a reference for us.
+  struct page_entry ** shm_pages;
+};
+
+// Protects the table and everything in the segments. Taken before a
+// page's lock.
+static struct lock * shm_lock;
+static struct shm_segment * shm_table[SHM_MAX];
+static unsigned int shm_count;
+
+// Statistics, printed by shm_printstats
+static unsigned long shm_attaches;
+static unsigned long shm_pages_made;
+
+static void shm_destroy(struct shm_segment *);
+
+void shm_bootstrap(void) {
+  shm_lock = lock_create("shm");
+  if (shm_lock == NULL) {
+    panic("shm_bootstrap: could not create lock\n");
+  }
+
+  for (unsigned int i = 0; i < SHM_MAX; i++) {
+    shm_table[i] = NULL;
+  }
+}
+
+int shm_get(int key, size_t size, int flags, int * id) {
+  int slot = -1;
+
+  lock_acquire(shm_lock);
+
+  for (int i = 0; i < SHM_MAX; i++) {
+    struct shm_segment * shm = shm_table[i];
+    if (shm == NULL) {
+      if (slot == -1) {
+        slot = i;
+      }
+      continue;
+    }
+
+    // Removed segments can only be found by whoever is still attached
+    if (key != IPC_PRIVATE && shm->shm_key == key && !shm->shm_removed) {
+      int result = 0;
+      if ((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+        result = EEXIST;
+      } else if (size > shm->shm_npages * PAGE_SIZE) {
+        result = EINVAL;
+      } else {
+        *id = i;
+      }
+      lock_release(shm_lock);
+      return result;
+    }
+  }
+
+  if (key != IPC_PRIVATE && !(flags & IPC_CREAT)) {
+    lock_release(shm_lock);
+    return ENOENT;
+  }
+  if (size == 0 || size > USERSPACETOP) {
+    lock_release(shm_lock);
+    return EINVAL;
+  }
+  if (slot == -1) {
+    lock_release(shm_lock);
+    return ENOSPC;
+  }
+
+  struct shm_segment * shm = kmalloc(sizeof(struct shm_segment));
+  unsigned int npages = DIVROUNDUP(size, PAGE_SIZE);
+  struct page_entry ** pages = kmalloc(npages * sizeof(struct page_entry *));
+  if (shm == NULL || pages == NULL) {
+    kfree(pages);
+    kfree(shm);
+    lock_release(shm_lock);
+    return ENOMEM;
+  }
+
+  for (unsigned int i = 0; i < npages; i++) {
+    pages[i] = NULL;
+  }
+
+  shm->shm_id = slot;
+  shm->shm_key = key;
+  shm->shm_npages = npages;
+  shm->shm_refs = 0;
+  shm->shm_removed = false;
+  shm->shm_pages = pages;
+
+  shm_table[slot] = shm;
+  shm_count++;
+
+  lock_release(shm_lock);
+
+  *id = slot;
+  return 0;
+}
+
+struct shm_segment * shm_attach(int id) {
+  if (id < 0 || id >= SHM_MAX) {
+    return NULL;
+  }
+
+  lock_acquire(shm_lock);
+
+  struct shm_segment * shm = shm_table[id];
+  if (shm != NULL && !shm->shm_removed) {
+    shm->shm_refs++;
+    shm_attaches++;
+  } else {
+    shm = NULL;
+  }
+
+  lock_release(shm_lock);
+  return shm;
+}
+
+void shm_ref(struct shm_segment * shm) {
+  lock_acquire(shm_lock);
+  KASSERT(shm->shm_refs > 0);
+  shm->shm_refs++;
+  lock_release(shm_lock);
+}
+
+void shm_detach(struct shm_segment * shm) {
+  lock_acquire(shm_lock);
+
+  KASSERT(shm->shm_refs > 0);
+  shm->shm_refs--;
+  bool last = shm->shm_refs == 0 && shm->shm_removed;
+  if (last) {
+    shm_table[shm->shm_id] = NULL;
+    shm_count--;
+  }
+
+  lock_release(shm_lock);
+
+  if (last) {
+    shm_destroy(shm);
+  }
+}
+
+int shm_remove(int id) {
+  if (id < 0 || id >= SHM_MAX) {
+    return EINVAL;
+  }
+
+  lock_acquire(shm_lock);
+
+  struct shm_segment * shm = shm_table[id];
+  if (shm == NULL || shm->shm_removed) {
+    lock_release(shm_lock);
+    return EINVAL;
+  }
+
+  shm->shm_removed = true;
+  bool last = shm->shm_refs == 0;
+  if (last) {
+    shm_table[id] = NULL;
+    shm_count--;
+  }
+
+  lock_release(shm_lock);
+
+  if (last) {
+    shm_destroy(shm);
+  }
+  return 0;
+}
+
+int shm_stat(int id, struct shmid_ds * ds) {
+  if (id < 0 || id >= SHM_MAX) {
+    return EINVAL;
+  }
+
+  lock_acquire(shm_lock);
+
+  struct shm_segment * shm = shm_table[id];
+  if (shm == NULL) {
+    lock_release(shm_lock);
+    return EINVAL;
+  }
+
+  ds->shm_segsz = shm->shm_npages * PAGE_SIZE;
+  ds->shm_nattch = shm->shm_refs;
+
+  lock_release(shm_lock);
+  return 0;
+}
+
+size_t shm_size(struct shm_segment * shm) {
+  return shm->shm_npages * PAGE_SIZE;
+}
+
+struct page_entry * shm_getpage(struct shm_segment * shm, unsigned int index,
+                                uint16_t hint) {
+  lock_acquire(shm_lock);
+
+  KASSERT(index < shm->shm_npages);
+  struct page_entry * page = shm->shm_pages[index];
+
+  if (page == NULL) {
+    paddr_t paddr = getppages(1, 0);
+    if (paddr == 0) {
+      lock_release(shm_lock);
+      return NULL;
+    }
+
+    page = kmalloc(sizeof(struct page_entry));
+    if (page == NULL) {
+      freeppage(paddr);
+      lock_release(shm_lock);
+      return NULL;
+    }
+
+    // Every attachment maps it somewhere else
+    page->pte = 0;
+    page->ppage_n = paddr;
+    page->vpage_n = VPAGE_ANYWHERE;
+    page->state = DIRTY;
+    page->swap_state = MEMORY;
+    page->bitmap_disk_index = 0;
+    page->swap_hint = hint;
+    page->refcount = 1;
+    page->prefetched = false;
+    page->readahead = false;
+    page->locked = false;
+    page->text = NULL;
+
+    shm->shm_pages[index] = page;
+    set_page_owner(page, paddr, NULL);
+    shm_pages_made++;
+  }
+
+  // Another reference for the caller's page table. Everybody's writes
+  // have to fault from now on, so that they get their own TLB entries.
+  page_share(page);
+
+  lock_release(shm_lock);
+  return page;
+}
+
+/* Free a segment that nobody can find any more */
+static void shm_destroy(struct shm_segment * shm) {
+  // Pages still mapped somewhere (by an address space on its way out)
+  // stay until they are unmapped
+  for (unsigned int i = 0; i < shm->shm_npages; i++) {
+    if (shm->shm_pages[i] != NULL) {
+      page_release(shm->shm_pages[i]);
+    }
+  }
+
+  kfree(shm->shm_pages);
+  kfree(shm);
+}
+
+void shm_printstats(void) {
+  kprintf("Shared memory: %u segments, %lu attaches, %lu pages made\n",
+          shm_count, shm_attaches, shm_pages_made);
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap slot allocator. See swapmap.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <swapmap.h>
+
+// Open clusters, one per hint modulo this. Hints that collide just share.
+#define SWAPMAP_CURSORS 32
+
+struct swapmap_cursor {
+  unsigned int sc_hint;
+  int sc_cluster;             // -1 if none is open
+  unsigned int sc_next;       // slot in the cluster to try first
+};
+
+static struct spinlock swapmap_lock = SPINLOCK_INITIALIZER;
+static unsigned int swapmap_slots;
+static unsigned int swapmap_clusters;
+static unsigned int swapmap_used;
+
+// One word per cluster, a bit per slot, set while allocated
+static uint32_t * swapmap_bits;
+
+// Summaries, a bit per cluster: completely free, and not completely used.
+// The top level has a bit per summary word that has any bits set.
+static uint32_t * swapmap_empty;
+static uint32_t * swapmap_partial;
+static uint32_t * swapmap_empty_top;
+static uint32_t * swapmap_partial_top;
+static unsigned int swapmap_summary_words;
+static unsigned int swapmap_top_words;
+
+static struct swapmap_cursor swapmap_cursors[SWAPMAP_CURSORS];
+
+// Statistics, printed by swapmap_printstats
+static unsigned long swapmap_opened;
+static unsigned long swapmap_batches;
+
+#define WORD(n) ((n) / 32)
+#define BIT(n)  ((uint32_t)1 << ((n) % 32))
+
+/* Index of the lowest set bit of a nonzero word */
+static unsigned int lowest_bit(uint32_t word) {
+  unsigned int bit = 0;
+
+  KASSERT(word != 0);
+  if ((word & 0xffff) == 0) { word >>= 16; bit += 16; }
+  if ((word & 0xff) == 0)   { word >>= 8;  bit += 8; }
+  if ((word & 0xf) == 0)    { word >>= 4;  bit += 4; }
+  if ((word & 0x3) == 0)    { word >>= 2;  bit += 2; }
+  if ((word & 0x1) == 0)    { bit += 1; }
+  return bit;
+}
+
+static uint32_t * swapmap_words(unsigned int n) {
+  uint32_t * words = kmalloc(n * sizeof(uint32_t));
+  if (words == NULL) {
+    panic("swapmap_bootstrap: out of memory\n");
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    words[i] = 0;
+  }
+  return words;
+}
+
+/* Set or clear a cluster's bit in a summary and its top level */
+static void summary_set(uint32_t * summary, uint32_t * top,
+                        unsigned int cluster, bool set) {
+  if (set) {
+    summary[WORD(cluster)] |= BIT(cluster);
+    top[WORD(WORD(cluster))] |= BIT(WORD(cluster));
+  } else {
+    summary[WORD(cluster)] &= ~BIT(cluster);
+    if (summary[WORD(cluster)] == 0) {
+      top[WORD(WORD(cluster))] &= ~BIT(WORD(cluster));
+    }
+  }
+}
+
+/* Find some cluster with its bit set in a summary, or -1 */
+static int summary_find(uint32_t * summary, uint32_t * top) {
+  for (unsigned int t = 0; t < swapmap_top_words; t++) {
+    if (top[t] != 0) {
+      unsigned int word = t * 32 + lowest_bit(top[t]);
+      return word * 32 + lowest_bit(summary[word]);
+    }
+  }
+  return -1;
+}
+
+/* Bring the summaries up to date after a cluster's word changed */
+static void cluster_update(unsigned int cluster) {
+  summary_set(swapmap_empty, swapmap_empty_top, cluster,
+              swapmap_bits[cluster] == 0);
+  summary_set(swapmap_partial, swapmap_partial_top, cluster,
+              swapmap_bits[cluster] != 0xffffffff);
+}
+
+void swapmap_bootstrap(unsigned int nslots) {
+  KASSERT(SWAPMAP_CLUSTER == 32);
+
+  // Only whole clusters get used
+  swapmap_clusters = nslots / SWAPMAP_CLUSTER;
+  swapmap_slots = swapmap_clusters * SWAPMAP_CLUSTER;
+  swapmap_summary_words = (swapmap_clusters + 31) / 32;
+  swapmap_top_words = (swapmap_summary_words + 31) / 32;
+
+  swapmap_bits = swapmap_words(swapmap_clusters);
+  swapmap_empty = swapmap_words(swapmap_summary_words);
+  swapmap_partial = swapmap_words(swapmap_summary_words);
+  swapmap_empty_top = swapmap_words(swapmap_top_words);
+  swapmap_partial_top = swapmap_words(swapmap_top_words);
+
+  for (unsigned int i = 0; i < swapmap_clusters; i++) {
+    cluster_update(i);
+  }
+
+  for (unsigned int i = 0; i < SWAPMAP_CURSORS; i++) {
+    swapmap_cursors[i].sc_cluster = -1;
+  }
+}
+
+int swapmap_alloc(unsigned int hint, unsigned int * slot) {
+  struct swapmap_cursor * sc = &swapmap_cursors[hint % SWAPMAP_CURSORS];
+
+  spinlock_acquire(&swapmap_lock);
+
+  // Keep going in the open cluster if there's room after the last slot
+  int cluster = sc->sc_cluster;
+  uint32_t avail = 0;
+  if (cluster != -1 && sc->sc_hint == hint && sc->sc_next < 32) {
+    avail = ~swapmap_bits[cluster] & ~(BIT(sc->sc_next) - 1);
+  }
+
+  // Otherwise open a new one, preferring an empty cluster
+  if (avail == 0) {
+    cluster = summary_find(swapmap_empty, swapmap_empty_top);
+    if (cluster == -1) {
+      cluster = summary_find(swapmap_partial, swapmap_partial_top);
+    }
+    if (cluster == -1) {
+      spinlock_release(&swapmap_lock);
+      return ENOSPC;
+    }
+    sc->sc_hint = hint;
+    sc->sc_cluster = cluster;
+    avail = ~swapmap_bits[cluster];
+    swapmap_opened++;
+  }
+
+  unsigned int bit = lowest_bit(avail);
+  swapmap_bits[cluster] |= BIT(bit);
+  cluster_update(cluster);
+  sc->sc_next = bit + 1;
+  swapmap_used++;
+
+  spinlock_release(&swapmap_lock);
+
+  *slot = cluster * SWAPMAP_CLUSTER + bit;
+  return 0;
+}
+
+/* Free a slot. Called with swapmap_lock held. */
+static void swapmap_free_locked(unsigned int slot) {
+  KASSERT(slot < swapmap_slots);
+  KASSERT(swapmap_bits[WORD(slot)] & BIT(slot));
+
+  swapmap_bits[WORD(slot)] &= ~BIT(slot);
+  cluster_update(WORD(slot));
+  swapmap_used--;
+}
+
+void swapmap_free(unsigned int slot) {
+  spinlock_acquire(&swapmap_lock);
+  swapmap_free_locked(slot);
+  spinlock_release(&swapmap_lock);
+}
+
+bool swapmap_isset(unsigned int slot) {
+  KASSERT(slot < swapmap_slots);
+  return (swapmap_bits[WORD(slot)] & BIT(slot)) != 0;
+}
+
+void swapmap_close(unsigned int hint) {
+  struct swapmap_cursor * sc = &swapmap_cursors[hint % SWAPMAP_CURSORS];
+
+  spinlock_acquire(&swapmap_lock);
+  if (sc->sc_hint == hint) {
+    sc->sc_cluster = -1;
+  }
+  spinlock_release(&swapmap_lock);
+}
+
+void swapmap_batch_add(struct swapmap_batch * batch, unsigned int slot) {
+  if (batch->sb_count == SWAPMAP_BATCH) {
+    swapmap_batch_flush(batch);
+  }
+  batch->sb_slots[batch->sb_count++] = slot;
+}
+
+void swapmap_batch_flush(struct swapmap_batch * batch) {
+  if (batch->sb_count == 0) {
+    return;
+  }
+
+  spinlock_acquire(&swapmap_lock);
+  for (unsigned int i = 0; i < batch->sb_count; i++) {
+    swapmap_free_locked(batch->sb_slots[i]);
+  }
+  swapmap_batches++;
+  spinlock_release(&swapmap_lock);
+
+  batch->sb_count = 0;
+}
+
+void swapmap_printstats(void) {
+  unsigned int empty = 0;
+  for (unsigned int i = 0; i < swapmap_clusters; i++) {
+    if (swapmap_bits[i] == 0) {
+      empty++;
+    }
+  }
+
+  kprintf("Swap map: %u of %u slots in use, %u of %u clusters empty\n",
+          swapmap_used, swapmap_slots, empty, swapmap_clusters);
+  kprintf("  %lu clusters opened, %lu batched frees\n", swapmap_opened,
+          swapmap_batches);
+}
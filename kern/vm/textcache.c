@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Cache of text pages shared between processes. See textcache.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <kern/stat.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <textcache.h>
+
+#define TEXTCACHE_BUCKETS 128
+
+// Where a cached page's contents live, and its hash chain
+struct text_page {
+  struct vnode * tp_vnode;
+  off_t tp_offset;
+  struct page_entry * tp_page;
+  struct text_page * tp_next;
+};
+
+// Protects the hash table, and the refcounts of the pages in it so that a
+// page can't be found again once it has dropped its last reference. Taken
+// before a page's lock.
+static struct lock * textcache_lock;
+static struct text_page * textcache[TEXTCACHE_BUCKETS];
+static unsigned int textcache_count;
+
+// Statistics, printed by textcache_printstats
+static unsigned long textcache_hits;
+static unsigned long textcache_misses;
+static unsigned long textcache_reads;
+static unsigned long textcache_writes;
+
+static unsigned int textcache_hash(struct vnode * v, off_t offset) {
+  return ((uintptr_t)v / sizeof(void *) + offset / PAGE_SIZE) %
+         TEXTCACHE_BUCKETS;
+}
+
+void textcache_bootstrap(void) {
+  textcache_lock = lock_create("textcache");
+  if (textcache_lock == NULL) {
+    panic("textcache_bootstrap: could not create lock\n");
+  }
+
+  for (unsigned int i = 0; i < TEXTCACHE_BUCKETS; i++) {
+    textcache[i] = NULL;
+  }
+}
+
+struct page_entry * textcache_get(struct vnode * v, off_t offset,
+                                  vaddr_t vaddr) {
+  unsigned int bucket = textcache_hash(v, offset);
+  struct text_page * tp;
+
+  lock_acquire(textcache_lock);
+
+  for (tp = textcache[bucket]; tp != NULL; tp = tp->tp_next) {
+    if (tp->tp_vnode == v && tp->tp_offset == offset &&
+        tp->tp_page->vpage_n == vaddr) {
+      struct page_entry * page = tp->tp_page;
+
+      // A shared mapping may have it writeable until now
+      KASSERT(page->refcount > 0);
+      page_share(page);
+
+      textcache_hits++;
+      lock_release(textcache_lock);
+      return page;
+    }
+  }
+
+  // First one to want it. The page starts out evicted, so the fault that
+  // asked for it reads it in the same way it would come back later.
+  tp = kmalloc(sizeof(struct text_page));
+  struct page_entry * page = kmalloc(sizeof(struct page_entry));
+  if (tp == NULL || page == NULL) {
+    kfree(page);
+    kfree(tp);
+    lock_release(textcache_lock);
+    return NULL;
+  }
+
+  page->pte = 0;
+  page->state = CLEAN;
+  page->swap_state = DISK;
+  page->vpage_n = vaddr;
+  page->ppage_n = 0;
+  page->bitmap_disk_index = 0;
+  page->swap_hint = 0;
+  page->refcount = 1;
+  page->prefetched = false;
+  page->readahead = false;
+  page->locked = false;
+  page->text = tp;
+
+  // Hold on to the file for as long as the page is cached
+  VOP_INCREF(v);
+  tp->tp_vnode = v;
+  tp->tp_offset = offset;
+  tp->tp_page = page;
+  tp->tp_next = textcache[bucket];
+  textcache[bucket] = tp;
+  textcache_count++;
+
+  textcache_misses++;
+  lock_release(textcache_lock);
+  return page;
+}
+
+bool textcache_put(struct page_entry * page) {
+  struct text_page * tp = page->text;
+  KASSERT(tp != NULL);
+
+  lock_acquire(textcache_lock);
+
+  page_lock(page);
+  KASSERT(page->refcount > 0);
+  page->refcount--;
+  bool last = page->refcount == 0;
+  page_unlock(page);
+
+  if (last) {
+    struct text_page ** link = &textcache[textcache_hash(tp->tp_vnode,
+                                                         tp->tp_offset)];
+    while (*link != tp) {
+      KASSERT(*link != NULL);
+      link = &(*link)->tp_next;
+    }
+    *link = tp->tp_next;
+    textcache_count--;
+  }
+
+  lock_release(textcache_lock);
+
+  if (last) {
+    // Nobody can find the page any more, but it may still have writes
+    // from a shared mapping in it
+    page_lock(page);
+    if (page->state == DIRTY && page->swap_state == MEMORY) {
+      textcache_write(page);
+      page->state = CLEAN;
+    }
+    page_unlock(page);
+
+    VOP_DECREF(tp->tp_vnode);
+    kfree(tp);
+  }
+
+  return last;
+}
+
+void textcache_read(struct page_entry * page, paddr_t paddr) {
+  struct text_page * tp = page->text;
+  struct iovec iov;
+  struct uio ku;
+
+  KASSERT(tp != NULL);
+
+  uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+            tp->tp_offset, UIO_READ);
+  int result = VOP_READ(tp->tp_vnode, &ku);
+
+  // The file was long enough when it was exec'd. If it has been cut short
+  // since, the program gets zeroes rather than whatever was in the frame.
+  if (result || ku.uio_resid != 0) {
+    size_t done = result ? 0 : PAGE_SIZE - ku.uio_resid;
+    bzero((void *)(PADDR_TO_KVADDR(paddr) + done), PAGE_SIZE - done);
+  }
+
+  textcache_reads++;
+}
+
+/*
+ * Called with the page locked, so that it can't be evicted (and its frame
+ * reused) while it is being written.
+ */
+void textcache_write(struct page_entry * page) {
+  struct text_page * tp = page->text;
+  struct stat st;
+  struct iovec iov;
+  struct uio ku;
+
+  KASSERT(tp != NULL);
+  KASSERT(page->locked && page->swap_state == MEMORY);
+
+  // Don't grow the file with the zeroes past its end
+  int result = VOP_STAT(tp->tp_vnode, &st);
+  if (result || st.st_size <= tp->tp_offset) {
+    return;
+  }
+  size_t len = st.st_size - tp->tp_offset < PAGE_SIZE ?
+               st.st_size - tp->tp_offset : PAGE_SIZE;
+
+  uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(page->ppage_n), len,
+            tp->tp_offset, UIO_WRITE);
+  result = VOP_WRITE(tp->tp_vnode, &ku);
+
+  // Nobody is around to tell, so all we can do is complain
+  if (result) {
+    kprintf("textcache: writing back page at %lld: %s\n",
+            (long long)tp->tp_offset, strerror(result));
+  }
+
+  textcache_writes++;
+}
+
+void textcache_printstats(void) {
+  kprintf("Text cache: %u pages, %lu hits, %lu misses, %lu reads, "
+          "%lu writes\n", textcache_count, textcache_hits, textcache_misses,
+          textcache_reads, textcache_writes);
+}
@@ -4,6 +4,7 @@
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
@@ -13,18 +14,417 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <stat.h>
-#include <bitmap.h>
 #include <device.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <uio.h>
 #include <kern/iovec.h>
+#include <platform/maxcpus.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <textcache.h>
+#include <swapmap.h>
+#include <zpool.h>
+#include <shm.h>
 
 /*
  * Wrap ram_stealmem in a spinlock.
  */
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Buddy allocator free lists, one per order. Each list holds the coremap
+ * index of the first page of a free block of 2^order pages, or -1 if empty.
+ */
+static int free_lists[COREMAP_MAX_ORDER + 1];
+
+// Number of coremap pages currently handed out (see coremap_used_bytes)
+static unsigned int coremap_used_pages;
+
+/*
+ * Per-CPU page caches ("magazines") sitting in front of coremap_lock.
+ *
+ * Single-page allocations and frees go to the current CPU's cache first,
+ * which only ever needs its own (normally uncontended) spinlock. When a
+ * cache runs dry it is refilled with PAGE_CACHE_BATCH pages taken from the
+ * buddy allocator in one go, and when it overflows the same number of pages
+ * is drained back. Pages sitting in a cache are marked FREE but are not on
+ * any free list, so the buddy allocator never merges them.
+ *
+ * Lock ordering: a page cache lock may be held while taking coremap_lock,
+ * never the other way around, and never two page cache locks at once.
+ */
+#define PAGE_CACHE_SIZE  16
+#define PAGE_CACHE_BATCH 8
+
+struct page_cache {
+  struct spinlock pc_lock;
+  unsigned int pc_count;
+  unsigned int pc_pages[PAGE_CACHE_SIZE];
+
+  // Statistics, printed by vm_printstats
+  unsigned long pc_hits;      // allocations served from the cache
+  unsigned long pc_misses;    // allocations that had to refill first
+  unsigned long pc_frees;     // pages freed into the cache
+  unsigned long pc_drains;    // batches pushed back to the coremap
+};
+
+static struct page_cache page_caches[MAXCPUS];
+
+/*
+ * Page replacement.
+ *
+ * Every resident USER page that has an owner sits on the resident queue,
+ * oldest first. resident_lock protects the queue along with the
+ * resident/referenced/busy/last_use fields of the coremap. Pages being
+ * evicted or pinned are marked busy and taken off the queue; anyone who
+ * needs such a page to settle sleeps on evict_wchan.
+ *
+ * The policy only has to pick a victim from the queue. Reference bits are
+ * set whenever vm_fault loads a translation. Policies that clear a page's
+ * reference bit also drop its TLB entry, so the next access faults again
+ * and sets the bit back.
+ */
+static struct spinlock resident_lock = SPINLOCK_INITIALIZER;
+static struct wchan * evict_wchan;
+static int resident_head = -1;
+static int resident_tail = -1;
+static unsigned int resident_count;
+
+// Virtual time: the number of faults taken so far
+static unsigned long vm_vtime;
+
+// Pages older than this (in faults) are outside the WSClock working set
+#define WSCLOCK_TAU 512
+static unsigned long wsclock_tau = WSCLOCK_TAU;
+
+// Pages after a faulting one that come in from swap with it when they were
+// swapped out next to it (see swap_in). 0 turns readahead off.
+#define SWAP_READAHEAD_DEFAULT 4
+static unsigned int swap_readahead = SWAP_READAHEAD_DEFAULT;
+
+// Statistics, printed by vm_printstats
+static unsigned long evict_count;
+static unsigned long evict_scanned;
+static unsigned long evict_broadcasts;     // shootdowns sent to every CPU
+static unsigned long sweep_skipped;        // bits left set, see clear_referenced
+
+// Other CPUs' TLB entries for pages whose reference bit the replacement
+// policy cleared, waiting for resident_lock to be let go. Protected by
+// resident_lock.
+static struct tlbshootdown sweep_ts;
+static uint32_t sweep_cpus;
+static unsigned long swap_reads;
+static unsigned long swap_writes;
+static unsigned long swap_clean_evictions;
+static unsigned long swap_write_ios;
+static unsigned long swap_ra_reads;
+static unsigned long swap_ra_hits;
+static unsigned long swap_ra_wasted;
+static unsigned long cow_copies;
+static unsigned long zero_page_maps;
+static unsigned long zero_page_copies;
+static unsigned long fault_exclusive;
+static unsigned long major_faults;
+static unsigned long file_pages_read;
+
+struct vm_policy {
+  const char * vp_name;
+
+  // Pick a page on the resident queue to evict, or -1 if there are none.
+  // Called with resident_lock held.
+  int (*vp_victim)(void);
+};
+
+static int fifo_victim(void);
+static int clock_victim(void);
+static int wsclock_victim(void);
+
+static const struct vm_policy vm_policies[] = {
+  { "fifo", fifo_victim },
+  { "clock", clock_victim },
+  { "wsclock", wsclock_victim },
+};
+
+static const struct vm_policy * vm_policy = &vm_policies[1];
+
+/*
+ * Pageout daemon.
+ *
+ * When the number of free pages drops below pageout_low, allocations wake
+ * the pageout thread, which evicts pages until pageout_high pages are free
+ * again. That way most faults find a free page right away instead of
+ * writing a victim out to swap themselves. Faulting threads still evict
+ * directly if the daemon can't keep up. A pass that frees nothing (swap is
+ * full, or everything resident is busy) makes the daemon back off for
+ * PAGEOUT_BACKOFF seconds rather than try again right away.
+ */
+#define PAGEOUT_LOW_MIN 8
+#define PAGEOUT_BACKOFF 1
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+static struct wchan * pageout_wchan;
+static unsigned int pageout_low;
+static unsigned int pageout_high;
+
+// Statistics, printed by vm_printstats
+static unsigned long pageout_wakeups;
+static unsigned long pageout_scanned;
+static unsigned long pageout_laundered;
+static unsigned long pageout_freed;
+static unsigned long pageout_stalls;
+
+/*
+ * Pool of pre-zeroed pages.
+ *
+ * Zeroing a page is the most expensive part of handing out a new anonymous
+ * page, so the pagezero thread does it ahead of time whenever the pool runs
+ * low, yielding after every page so it only really runs when the CPU would
+ * otherwise be idle. Like the per-CPU caches, pages in the pool are marked
+ * FREE but aren't on any free list. The pool only fills while memory is
+ * plentiful, and is given back when an allocation would otherwise fail.
+ */
+#define ZERO_POOL_SIZE 64
+#define ZERO_POOL_LOW  16
+
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+static struct wchan * zero_wchan;
+static unsigned int zero_count;
+static unsigned int zero_pages[ZERO_POOL_SIZE];
+
+// Pages in the pool plus pages being zeroed for it. Taking pages from the
+// buddy allocator for the pool updates this under coremap_lock, so that
+// coremap_used_bytes never sees a page go missing on the way.
+static unsigned int zero_reserved;
+
+// Statistics, printed by vm_printstats
+static unsigned long zero_hits;
+static unsigned long zero_misses;
+static unsigned long zero_filled;
+
+// Statistics, printed by vm_printstats
+static unsigned long free_batches;
+static unsigned long free_batch_pages;
+
+/*
+ * Reaper.
+ *
+ * Freeing the pages of a big address space takes a while even a batch at
+ * a time, and the parent of the exiting process is usually sitting in
+ * waitpid until it is over. Address spaces with at least reaper_threshold
+ * pages are queued for the reaper thread instead, which frees them in the
+ * background. Their pages stay on the resident queue until then, so
+ * eviction can still take them if memory runs short in the meantime.
+ *
+ * The reaper is off (threshold 0) until the exitlat numbers say where the
+ * threshold should be; turn it on from the menu with "reaper 1024" or so.
+ */
+static unsigned int reaper_threshold = 0;
+
+static struct spinlock reaper_lock = SPINLOCK_INITIALIZER;
+static struct wchan * reaper_wchan;
+static struct addrspace * reaper_head;
+static struct addrspace * reaper_tail;
+
+// Statistics, printed by vm_printstats
+static unsigned long reaper_spaces;
+static unsigned long reaper_pages;
+
+/*
+ * Load control.
+ *
+ * Once a second the loadctl thread looks at what share of the faults since
+ * the last time had to bring a page back from swap. When that is over
+ * LOADCTL_THRASH_PERCENT, processes are stealing each other's pages faster
+ * than they get work done, so the address space that faulted the most
+ * (the one with the highest page fault frequency) is suspended: its
+ * thread stops at its next fault from user mode, moves all its pages to
+ * the front of the resident queue for eviction, and sleeps. While the
+ * fault rate stays under LOADCTL_RESUME_PERCENT, suspended address spaces
+ * that have been out for LOADCTL_MIN_SUSPEND seconds are let go again one
+ * per second, oldest first, and none stays out longer than
+ * LOADCTL_MAX_SUSPEND seconds, so they take turns when memory never gets
+ * any better.
+ *
+ * Load control is off by default until there are quintmat and parallelvm
+ * numbers with it on; turn it on from the menu with "loadctl on".
+ *
+ * Suspending the last address space that is still running would get
+ * nothing done, so at least two have to be faulting. lc_top and lc_target
+ * are only compared against, never followed, but vm_reap clears them when
+ * their address space goes away, or a new one allocated at the same
+ * address would be taken for it.
+ */
+#define LOADCTL_MIN_FAULTS     64
+#define LOADCTL_THRASH_PERCENT 50
+#define LOADCTL_RESUME_PERCENT 20
+#define LOADCTL_MIN_SUSPEND    2
+#define LOADCTL_MAX_SUSPEND    5
+
+static bool loadctl_enabled;
+static struct spinlock lc_lock = SPINLOCK_INITIALIZER;
+static struct wchan * lc_wchan;
+static unsigned int lc_period = 1;            // seconds the thread has run
+static unsigned int lc_spaces;                // address spaces faulting
+static unsigned int lc_top_faults;
+static struct addrspace * lc_top;             // faulted the most so far
+static struct addrspace * lc_target;          // to suspend at next fault
+static struct addrspace * lc_suspended_head;  // suspended, oldest first
+static struct addrspace * lc_suspended_tail;
+
+// Statistics, printed by vm_printstats
+static unsigned long lc_suspensions;
+static unsigned long lc_resumptions;
+static unsigned int lc_suspended;
+
+/*
+ * Application advice (see vm_madvise). Faults in a MADV_SEQUENTIAL segment
+ * read as far ahead in swap as one transfer goes, and send the page
+ * ADVICE_BEHIND pages back to the front of the resident queue, since a scan
+ * isn't coming back for it. MADV_RANDOM turns readahead and fault-around
+ * off for the segment.
+ */
+#define ADVICE_BEHIND 8
+
+// Statistics, printed by vm_printstats
+static unsigned long advice_behind;
+static unsigned long advice_willneed;
+static unsigned long advice_dontneed;
+
+/*
+ * Page locks. Rather than a lock object per page, each page has a lock bit
+ * protected by one of a few spinlocks, and waits on the wait channel that
+ * goes with it. Pages hash to them by address.
+ */
+#define PAGE_LOCK_BUCKETS 32
+
+static struct page_lock_bucket {
+  struct spinlock plb_lock;
+  struct wchan * plb_wchan;
+} page_lock_buckets[PAGE_LOCK_BUCKETS];
+
+/*
+ * The zero page. Reading an anonymous page that has never been written
+ * maps this one read-only frame of zeroes instead of giving the process a
+ * page of its own; the first write breaks the sharing like any other
+ * copy-on-write page. The kernel holds a reference of its own, so the page
+ * is never freed, and it isn't on the resident queue, so it is never
+ * evicted.
+ */
+static struct page_entry * zero_page;
+
+/*
+ * TLB address space IDs.
+ *
+ * TLB entries are tagged with the ASID of the address space that loaded
+ * them, so switching address spaces only has to change the current ASID
+ * instead of flushing the TLB. ASIDs are handed out per CPU: an address
+ * space gets one the first time it runs on a CPU, and a new one once that
+ * CPU has run out and started a new generation. Starting a new
+ * generation flushes that CPU's TLB, which is what makes reusing the old
+ * ASIDs safe. ASID 0 is never handed out.
+ *
+ * Only the CPU that runs the code touches its own entry, with interrupts
+ * off, so none of this needs a lock.
+ *
+ * Translations that go away are shot down on the other CPUs with a batch
+ * of pages per IPI: just the CPUs in the address space's as_cpus mask when
+ * we know the address space, every CPU when we don't (evicting a page more
+ * than one address space may have; see page_set_owner). The sender waits
+ * until every target has dropped its entries.
+ */
+struct tlb_cpu {
+  unsigned int tc_next;           // next ASID to hand out
+  unsigned int tc_generation;     // bumped every time the ASIDs run out
+  unsigned int tc_current;        // ASID currently loaded
+
+  // Statistics, printed by vm_printstats
+  unsigned long tc_rollovers;
+  unsigned long tc_flushes;
+  unsigned long tc_sent;          // shootdowns sent to other CPUs
+  unsigned long tc_received;      // shootdowns handled for other CPUs
+};
+
+static struct tlb_cpu tlb_cpus[MAXCPUS];
+
+// Shootdown targets count this down once they are done
+struct tlbshootdown_ack {
+  struct spinlock tsa_lock;
+  unsigned int tsa_pending;
+};
+
+/*
+ * Fault-around.
+ *
+ * After a fault, vm_fault_around also loads TLB entries for up to a window
+ * of neighbouring pages in the same segment, so a sequential scan over
+ * resident pages doesn't take a fault on every one of them. Only pages
+ * without a pte are worth it; the refill handler loads the rest cheaply.
+ * Those are mostly pages the replacement policy is sampling, so a page that
+ * gets loaded is treated as if it had faulted: it is marked referenced and
+ * gets its pte back.
+ *
+ * The TLB doesn't say whether an entry got used, so a prefetched page stays
+ * marked until the policy can tell: a fault on it after the clock hand has
+ * cleared its bit means it was used, and evicting it while it is still
+ * marked means it was loaded for nothing. Each address space grows its
+ * window while that rarely happens and shrinks it while it often does,
+ * backing off completely for a while if the window gets down to nothing.
+ */
+#define FAULT_AROUND_MAX 16
+#define FAULT_AROUND_DEFAULT 8
+#define FAULT_AROUND_SAMPLE 32     // prefetches between window adjustments
+#define FAULT_AROUND_COOLDOWN 64   // faults to sit out after backing off
+
+static unsigned int fault_around_max = FAULT_AROUND_DEFAULT;
+
+// Statistics, printed by vm_printstats
+static unsigned long fa_prefetched;
+static unsigned long fa_used;
+static unsigned long fa_wasted;
+static struct timespec vmstat_last_time;
+static unsigned long vmstat_last_faults;
+
+static void free_list_push(unsigned int, unsigned int);
+static void free_list_remove(unsigned int);
+static void coremap_free_range(unsigned int, unsigned int);
+static bool vm_tlb_load_resident(struct page_entry *, vaddr_t, bool, bool,
+                                 bool *);
+static bool page_from_file(struct addrspace *, vaddr_t);
+static int vm_fault_locked(struct addrspace *, int, vaddr_t, bool *);
+static struct page_entry * vm_fault_insert(struct addrspace *, vaddr_t,
+                                           struct page_entry *);
+static int page_read_file(struct addrspace *, vaddr_t, paddr_t);
+static void page_set_owner(struct page_entry *, paddr_t, struct addrspace *,
+                           bool);
+static void vm_fault_around(struct addrspace *, struct segment_entry *,
+                            vaddr_t);
+static void vm_tlb_sweep_flush(void);
+static void page_set_dirty(struct addrspace *, struct page_entry *, bool);
+static struct page_entry * page_cow_break(struct addrspace *, vaddr_t,
+                                          struct page_entry *);
+static void coremap_wait_unbusy(struct page_entry *);
+static int coremap_evict(void);
+static unsigned int coremap_free_pages(void);
+static int zero_pool_get(void);
+static void zero_pool_drain(void);
+static void pagezero_thread(void *, unsigned long);
+static void page_free_batch_drain(struct page_free_batch *);
+static void page_free_frames(struct page_entry **, unsigned int);
+static void page_free_entry(struct page_entry *, struct swapmap_batch *);
+static void reaper_thread(void *, unsigned long);
+static void loadctl_fault(struct addrspace *);
+static void loadctl_suspend(struct addrspace *);
+static void loadctl_deactivate(vaddr_t, struct page_entry *, void *);
+static void loadctl_resume(void);
+static bool page_deactivate(struct page_entry *);
+static bool vm_range_mapped(struct addrspace *, vaddr_t, vaddr_t);
+static void vm_willneed(struct addrspace *, vaddr_t, vaddr_t);
+static void loadctl_thread(void *, unsigned long);
+static void pageout_wake(void);
+static void pageout_thread(void *, unsigned long);
+
 /* Helper for calculating number of pages. This does all the math computation */
 paddr_t calculate_range(unsigned int pages) {
   // |-----------------l---l---------------------------------------------|
@@ -98,16 +498,115 @@ void coremap_bootstrap() {
     coremap[i].state = FREE;
     coremap[i].block_size = 0;
     coremap[i].owner = NULL;
+    coremap[i].as = NULL;
+    coremap[i].free_head = false;
+    coremap[i].order = 0;
+    coremap[i].next = -1;
+    coremap[i].prev = -1;
+    coremap[i].resident = false;
+    coremap[i].referenced = false;
+    coremap[i].busy = false;
+    coremap[i].last_use = 0;
   }
 
+  for (unsigned int i=0; i<=COREMAP_MAX_ORDER; i++) {
+    free_lists[i] = -1;
+  }
+
+  for (unsigned int i=0; i<MAXCPUS; i++) {
+    spinlock_init(&page_caches[i].pc_lock);
+    page_caches[i].pc_count = 0;
+
+    tlb_cpus[i].tc_next = 1;
+    tlb_cpus[i].tc_generation = 1;
+    tlb_cpus[i].tc_current = 0;
+  }
+
+  // Hand every page to the buddy allocator. The range gets split into the
+  // largest naturally aligned blocks that fit.
+  coremap_used_pages = COREMAP_PAGES;
+  coremap_free_range(0, COREMAP_PAGES);
+  KASSERT(coremap_used_pages == 0);
+
   vm_booted = false;
 
 }
 
 
+/* Set up the page lock buckets */
+static void page_lock_bootstrap(void) {
+  for (unsigned int i = 0; i < PAGE_LOCK_BUCKETS; i++) {
+    spinlock_init(&page_lock_buckets[i].plb_lock);
+    page_lock_buckets[i].plb_wchan = wchan_create("page lock");
+    if (page_lock_buckets[i].plb_wchan == NULL) {
+      panic("vm_bootstrap: could not create page lock wchan\n");
+    }
+  }
+}
+
+/* Set up the zero page */
+static void zero_page_bootstrap(void) {
+  paddr_t paddr = getppages(1, VM_ALLOC_KERNEL);
+  zero_page = kmalloc(sizeof(struct page_entry));
+  if (paddr == 0 || zero_page == NULL) {
+    panic("vm_bootstrap: could not allocate the zero page\n");
+  }
+
+  // Always resident, and CLEAN so that it is never mapped writeable
+  zero_page->ppage_n = paddr;
+  zero_page->vpage_n = 0;
+  zero_page->state = CLEAN;
+  zero_page->swap_state = MEMORY;
+  zero_page->bitmap_disk_index = 0;
+  zero_page->swap_hint = 0;
+  zero_page->refcount = 1;
+  zero_page->pte = paddr | TLBLO_VALID;
+  zero_page->prefetched = false;
+  zero_page->readahead = false;
+  zero_page->text = NULL;
+  zero_page->locked = false;
+
+  coremap[(paddr - coremap_pagestartaddr) / PAGE_SIZE].owner = zero_page;
+}
+
 /* Initialization function */
 void vm_bootstrap() {
 
+  // Start of the first vmstat fault rate period
+  gettime(&vmstat_last_time);
+
+  evict_wchan = wchan_create("evict");
+  if (evict_wchan == NULL) {
+    panic("vm_bootstrap: could not create evict wchan\n");
+  }
+
+  zero_wchan = wchan_create("pagezero");
+  if (zero_wchan == NULL) {
+    panic("vm_bootstrap: could not create pagezero wchan\n");
+  }
+
+  int result = thread_fork("pagezero", NULL, pagezero_thread, NULL, 0);
+  if (result) {
+    panic("vm_bootstrap: could not start pagezero thread: %s\n",
+          strerror(result));
+  }
+
+  reaper_wchan = wchan_create("reaper");
+  if (reaper_wchan == NULL) {
+    panic("vm_bootstrap: could not create reaper wchan\n");
+  }
+
+  result = thread_fork("reaper", NULL, reaper_thread, NULL, 0);
+  if (result) {
+    panic("vm_bootstrap: could not start reaper thread: %s\n",
+          strerror(result));
+  }
+
+  page_lock_bootstrap();
+  zero_page_bootstrap();
+  textcache_bootstrap();
+  shm_bootstrap();
+
   // Swap disk name
   char * swap_disk_name = (char *) "lhd0raw:";
 
@@ -137,175 +636,359 @@ void vm_bootstrap() {
   //   b Else enable swapping
   can_swap = true;
 
-  // If swapping, create bitmap size of disk / 4K (use vop_stat for size)
+  // If swapping, one slot per 4K of disk (use vop_stat for size)
   off_t swap_disk_size = stats.st_size;
   swap_disk_pages = swap_disk_size / PAGE_SIZE;
 
-  if (swap_disk_pages < 1) {
+  if (swap_disk_pages < SWAPMAP_CLUSTER) {
     can_swap = false;
     vm_booted = true;
     return;
   }
 
-  // Create the bitmap
-  disk_bitmap = bitmap_create(swap_disk_pages);
-  // Set up bitmap
-  KASSERT(disk_bitmap != NULL);
+  // Set up the slot allocator
+  swapmap_bootstrap(swap_disk_pages);
+  zpool_bootstrap(swap_disk_pages);
 
   // Initialize above here
   vm_booted = true;
 
-  bitmap_lock = lock_create("bitmap lock");
+  // Start the pageout daemon. Keep about 3% of memory free by default.
+  pageout_low = COREMAP_PAGES / 32;
+  if (pageout_low < PAGEOUT_LOW_MIN) {
+    pageout_low = PAGEOUT_LOW_MIN;
+  }
+  pageout_high = pageout_low * 2;
 
-  // Make sure we really booted
-  KASSERT(vm_booted); // wot
-}
+  pageout_wchan = wchan_create("pageout");
+  if (pageout_wchan == NULL) {
+    panic("vm_bootstrap: could not create pageout wchan\n");
+  }
 
-int block_read(unsigned int swap_disk_index, paddr_t write_to_paddr) {
+  result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+  if (result) {
+    panic("vm_bootstrap: could not start pageout thread: %s\n",
+          strerror(result));
+  }
+
+  // Start the load controller; it only matters when there is swap, and
+  // stays off until turned on from the menu
+  lc_wchan = wchan_create("loadctl");
+  if (lc_wchan == NULL) {
+    panic("vm_bootstrap: could not create loadctl wchan\n");
+  }
 
-  // Create UIO and IOVec
-  struct uio reader_uio;
-  struct iovec reader_iovec;
-  int remaining = PAGE_SIZE; // The remaining bytes to read (these are pages)
-  unsigned long coremap_index = (write_to_paddr - coremap_pagestartaddr) / PAGE_SIZE;
+  result = thread_fork("loadctl", NULL, loadctl_thread, NULL, 0);
+  if (result) {
+    panic("vm_bootstrap: could not start loadctl thread: %s\n",
+          strerror(result));
+  }
 
-  // Determine where to store the data being read.
-  reader_iovec.iov_ubase = (void *) PADDR_TO_KVADDR(write_to_paddr);
-  reader_iovec.iov_len = PAGE_SIZE;
+  // Make sure we really booted
+  KASSERT(vm_booted); // wot
+}
 
-  reader_uio.uio_iov = &reader_iovec;
-  reader_uio.uio_iovcnt = 1;
+/*
+ * Move n pages between consecutive swap slots starting at swap_disk_index
+ * and the frames in paddrs, in one transfer. The caller holds the pages'
+ * page locks.
+ */
+static int block_io(unsigned int swap_disk_index, const paddr_t * paddrs,
+                    unsigned int n, enum uio_rw rw) {
+  struct uio block_uio;
+  struct iovec block_iovec[SWAP_IO_MAX];
 
-  // Set up for reading
-  reader_uio.uio_rw = UIO_READ;
-  reader_uio.uio_segflg = UIO_SYSSPACE;
-  reader_uio.uio_resid = PAGE_SIZE;
+  KASSERT(n > 0 && n <= SWAP_IO_MAX);
 
-  // There is no address space for this read operation.
-  reader_uio.uio_space = NULL;
+  // One iovec per frame, since the frames needn't be contiguous
+  for (unsigned int i = 0; i < n; i++) {
+    block_iovec[i].iov_kbase = (void *) PADDR_TO_KVADDR(paddrs[i]);
+    block_iovec[i].iov_len = PAGE_SIZE;
+  }
 
-  // Find the offset of the page stored in the swapdisk
-  reader_uio.uio_offset = swap_disk_index * PAGE_SIZE;
+  block_uio.uio_iov = block_iovec;
+  block_uio.uio_iovcnt = n;
+  block_uio.uio_rw = rw;
+  block_uio.uio_segflg = UIO_SYSSPACE;
+  block_uio.uio_resid = n * PAGE_SIZE;
 
-  // Atomic operation
-  lock_acquire(coremap[coremap_index].owner->swap_lock);
+  // There is no address space for this operation.
+  block_uio.uio_space = NULL;
 
-  // Read operations
-  int result = VOP_READ(swap_vnode, &reader_uio);
-  // Update amount of data transferred.
-  remaining -= reader_uio.uio_resid;
+  // Find the offset of the first page stored in the swapdisk
+  block_uio.uio_offset = (off_t) swap_disk_index * PAGE_SIZE;
 
-  lock_release(coremap[coremap_index].owner->swap_lock);
+  int result;
+  if (rw == UIO_READ) {
+    result = VOP_READ(swap_vnode, &block_uio);
+  } else {
+    result = VOP_WRITE(swap_vnode, &block_uio);
+  }
 
-  //KASSERT(result == 0 && remaining == 0);
-  (void) result;
-  (void) remaining;
-  return 0;
+  KASSERT(result == 0 && block_uio.uio_resid == 0);
+  return result;
 }
 
+int block_read(unsigned int swap_disk_index, paddr_t write_to_paddr) {
+  return block_io(swap_disk_index, &write_to_paddr, 1, UIO_READ);
+}
 
 int block_write(unsigned int swap_disk_index, paddr_t read_from_paddr) {
+  return block_io(swap_disk_index, &read_from_paddr, 1, UIO_WRITE);
+}
 
-  // Create UIO and IOVec
-  struct uio writer_uio;
-  struct iovec writer_iovec;
-  int remaining = PAGE_SIZE; // The remaining bytes to read (these are pages)
-  unsigned long coremap_index = (read_from_paddr - coremap_pagestartaddr) / PAGE_SIZE;
+/*
+ * Find the pages of seg right after page whose copies sit in the swap slots
+ * right after page's, up to swap_readahead of them, and get frames for them
+ * without evicting anything. Only our own thread can dirty our private
+ * pages, so peeking at their swap state without their locks is safe; it is
+ * checked again under the lock before the pages are installed.
+ */
+static unsigned int swap_readahead_collect(struct addrspace * as,
+                                           struct segment_entry * seg,
+                                           struct page_entry * page,
+                                           struct page_entry ** pages,
+                                           paddr_t * paddrs) {
+  vaddr_t seg_end = seg->region_start + seg->region_size;
+  unsigned int n = 0;
+
+  // Sequential scans will want all of it, random access none of it
+  unsigned int max = swap_readahead;
+  if (seg->advice == MADV_SEQUENTIAL) {
+    max = SWAP_IO_MAX - 1;
+  } else if (seg->advice == MADV_RANDOM) {
+    max = 0;
+  }
 
-  // Determine where to store the data being read.
-  writer_iovec.iov_ubase = (void *) PADDR_TO_KVADDR(read_from_paddr);
-  writer_iovec.iov_len = PAGE_SIZE;
+  while (n < max) {
+    vaddr_t vaddr = page->vpage_n + (n + 1) * PAGE_SIZE;
+    if (vaddr >= seg_end) {
+      break;
+    }
 
-  writer_uio.uio_iov = &writer_iovec;
-  writer_uio.uio_iovcnt = 1;
+    struct page_entry * next = pt_lookup(&as->as_pt, vaddr);
+    if (next == NULL || next->text != NULL || next->swap_state != DISK ||
+        next->bitmap_disk_index != page->bitmap_disk_index + n + 1) {
+      break;
+    }
 
-  // Set up for writing
-  writer_uio.uio_rw = UIO_WRITE;
-  writer_uio.uio_segflg = UIO_SYSSPACE;
-  writer_uio.uio_resid = PAGE_SIZE;
+    // Its copy on disk is out of date while the compressed pool has it
+    if (zpool_contains(next->bitmap_disk_index)) {
+      break;
+    }
 
-  // There is no address space for this read operation.
-  writer_uio.uio_space = NULL;
+    paddr_t paddr = getppages(1, VM_ALLOC_NOZERO | VM_ALLOC_NOEVICT);
+    if (paddr == 0) {
+      break;
+    }
 
-  // Find the offset of the page stored in the swapdisk
-  writer_uio.uio_offset = swap_disk_index * PAGE_SIZE;
+    pages[n] = next;
+    paddrs[n] = paddr;
+    n++;
+  }
 
-  // Atomic operation
-  lock_acquire(coremap[coremap_index].owner->swap_lock);
+  return n;
+}
 
-  // kprintf("Reading From %x\n", read_from_paddr);
-  // kprintf("Coremap index: %lu\n", coremap_index);
-  // kprintf("Writing offset: %x\n\n", swap_disk_index * PAGE_SIZE);
+/*
+ * Make a page read ahead into paddr from slot resident, unless it was
+ * swapped in or freed while the read was going on.
+ */
+static void swap_readahead_install(struct addrspace * as,
+                                   struct page_entry * page, paddr_t paddr,
+                                   unsigned int slot) {
+  page_lock(page);
+
+  if (page->swap_state == DISK && page->bitmap_disk_index == slot) {
+    page->ppage_n = paddr;
+    page_set_owner(page, paddr, as, true);
+    page->swap_state = MEMORY;
+  } else {
+    freeppage(paddr);
+  }
 
-  // Write operations
-  int result = VOP_WRITE(swap_vnode, &writer_uio);
+  page_unlock(page);
+}
 
-  lock_release(coremap[coremap_index].owner->swap_lock);
+/*
+ * Read an evicted page back from disk into paddr, a frame the caller has
+ * just allocated for it, and make the page resident there. The page keeps
+ * its swap slot and comes back CLEAN, unless it was in the compressed pool,
+ * which gives up both. A shared page always keeps them, since its sharers
+ * may be reading the slot without waiting for it to come back in (see
+ * page_cow_break). Returns false, leaving paddr unused,
+ * if a process sharing the page swapped it in first.
+ * If as and seg are given, the following pages of seg that were swapped out
+ * next to this one come in with the same read.
+ */
+bool swap_in(struct addrspace * as, struct segment_entry * seg,
+             struct page_entry * page, paddr_t paddr) {
+  struct page_entry * ra_pages[SWAP_IO_MAX - 1];
+  paddr_t paddrs[SWAP_IO_MAX];
+  unsigned int ra = 0;
 
-  KASSERT(result == 0 && writer_uio.uio_resid == 0);
-  (void) result;
-  (void) remaining;
-  return 0;
-}
+  page_lock(page);
 
-int swap_in(struct page_entry * page) {
-  // Where in disk is it stored
-  unsigned int bitmap_index = page->bitmap_disk_index;
+  if (page->swap_state == MEMORY) {
+    page_unlock(page);
+    return false;
+  }
 
-  lock_acquire(bitmap_lock);
   // Make sure that it is actually in disk
-  KASSERT(bitmap_isset(disk_bitmap, bitmap_index));
+  KASSERT(page->state == CLEAN);
+
+  if (page->text != NULL) {
+    // Shared text comes from the executable instead
+    textcache_read(page, paddr);
+  } else if (page->refcount > 1 &&
+             zpool_read(page->bitmap_disk_index, paddr)) {
+    // The copy stays in the pool for the other sharers
+  } else if (page->refcount == 1 &&
+             zpool_load(page->bitmap_disk_index, paddr)) {
+    // The compressed pool no longer has a copy, so neither does the slot
+    swapmap_free(page->bitmap_disk_index);
+    page->state = DIRTY;
+  } else {
+    KASSERT(swapmap_isset(page->bitmap_disk_index));
+
+    paddrs[0] = paddr;
+    if (as != NULL && seg != NULL && page->vpage_n != VPAGE_ANYWHERE) {
+      ra = swap_readahead_collect(as, seg, page, ra_pages, &paddrs[1]);
+    }
 
-  // Try to swap in
-  int error = block_read(bitmap_index, page->ppage_n);
+    // Try to swap in
+    int error = block_io(page->bitmap_disk_index, paddrs, ra + 1, UIO_READ);
 
-  // Make sure we did this right
-  KASSERT(error == 0);
+    // Make sure we did this right
+    KASSERT(error == 0);
+    swap_reads += ra + 1;
+    swap_ra_reads += ra;
+  }
 
+  // Register the frame before anyone sharing the page can see it resident
+  page->ppage_n = paddr;
+  set_page_owner(page, paddr, as);
   page->swap_state = MEMORY;
-  bitmap_unmark(disk_bitmap, bitmap_index);
-  lock_release(bitmap_lock);
 
-  return 0;
+  unsigned int slot = page->bitmap_disk_index;
+
+  page_unlock(page);
+
+  for (unsigned int i = 0; i < ra; i++) {
+    swap_readahead_install(as, ra_pages[i], paddrs[i + 1], slot + i + 1);
+  }
+
+  return true;
 }
 
-int swap_out(struct page_entry * page) {
+/*
+ * Move n resident pages out to swap. A CLEAN page already has an up to date
+ * copy in its slot and costs no I/O; a DIRTY page is written to a new slot
+ * and becomes CLEAN. Pages from the same address space get neighbouring
+ * slots, and runs of consecutive slots go out in one write. Dirty pages of
+ * shared file mappings are written back to their file instead, but only if
+ * write_files is set. Sets errors[i] to ENOSPC if pages[i] didn't fit in
+ * swap, EBUSY if it needed writing to a file we may not write, 0 otherwise.
+ * The pages' frames can be reused once this returns.
+ */
+void swap_out_batch(struct page_entry ** pages, unsigned int n, int * errors,
+                    bool write_files) {
+  unsigned int order[SWAP_IO_MAX];
+  unsigned int slots[SWAP_IO_MAX];
+  unsigned int nwrites = 0;
+
+  KASSERT(n <= SWAP_IO_MAX);
 
-  // Get a bitmap index
-  lock_acquire(bitmap_lock);
-  unsigned int bitmap_index;
-  bitmap_alloc(disk_bitmap, &bitmap_index);
+  for (unsigned int i = 0; i < n; i++) {
+    struct page_entry * page = pages[i];
 
-  // kprintf("\nSwap out to %u\n", bitmap_index);
-  // kprintf("Swapping out page at %x\n", page->ppage_n);
+    page_lock(page);
+    errors[i] = 0;
 
-  // Try to swap out the page
-  int error = block_write(bitmap_index, page->ppage_n);
+    if (page->state == CLEAN) {
+      swap_clean_evictions++;
+      continue;
+    }
+
+    if (page->text != NULL) {
+      if (!write_files) {
+        errors[i] = EBUSY;
+        continue;
+      }
+      textcache_write(page);
+      page->state = CLEAN;
+      continue;
+    }
+
+    // Get a slot near the others of the address space the page came from
+    if (swapmap_alloc(page->swap_hint, &slots[i])) {
+      // Swap is full
+      errors[i] = ENOSPC;
+      continue;
+    }
+
+    // Compressing the page beats writing it out
+    if (zpool_store(slots[i], page->ppage_n)) {
+      continue;
+    }
 
-  KASSERT(error == 0);
+    // Keep the writes sorted by slot
+    unsigned int j = nwrites++;
+    while (j > 0 && slots[order[j - 1]] > slots[i]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
 
-  // Update the page entry
-  page->swap_state = DISK;
-  page->bitmap_disk_index = bitmap_index;
+  // Write out each run of consecutive slots at once
+  for (unsigned int start = 0; start < nwrites; ) {
+    paddr_t paddrs[SWAP_IO_MAX];
+    unsigned int len = 0;
 
-  lock_release(bitmap_lock);
+    do {
+      paddrs[len] = pages[order[start + len]]->ppage_n;
+      len++;
+    } while (start + len < nwrites &&
+             slots[order[start + len]] == slots[order[start]] + len);
 
-  // Zero the page
-  as_zero_region(page->ppage_n, 1);
+    int error = block_io(slots[order[start]], paddrs, len, UIO_WRITE);
+    KASSERT(error == 0);
 
-  return 0;
+    swap_writes += len;
+    swap_write_ios++;
+    start += len;
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    struct page_entry * page = pages[i];
+
+    if (errors[i] == 0) {
+      if (page->state == DIRTY) {
+        page->bitmap_disk_index = slots[i];
+        page->state = CLEAN;
+      }
+
+      // Update the page entry
+      page->swap_state = DISK;
+    }
+
+    page_unlock(page);
+  }
 }
 
 /* Fault handling function called by trap code */
 /*
  * When vm_fault is called, that means the process attempted to find a
  * matching
+ *
+ * Faults hold the address space's lock for reading, so any number of them
+ * can be going on in one address space at once. Breaking copy-on-write
+ * sharing replaces a page in the page table and drops the old one, which
+ * nobody else may be looking at, so that takes the lock for writing.
  */
 int vm_fault(int faulttype, vaddr_t faultaddress) {
-  // Declare these variables for use later.
-  paddr_t paddr = 0;
   struct addrspace *as;
-  int spl;
 
   if (curproc == NULL) {
     /*
@@ -323,6 +1006,38 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
     return EFAULT;
   }
 
+  // Virtual time for the replacement policy
+  vm_vtime++;
+
+  if (loadctl_enabled) {
+    loadctl_fault(as);
+  }
+
+  bool exclusive = false;
+  rwlock_acquire_read(as->as_lock);
+  int result = vm_fault_locked(as, faulttype, faultaddress, &exclusive);
+  rwlock_release_read(as->as_lock);
+
+  if (exclusive) {
+    fault_exclusive++;
+    rwlock_acquire_write(as->as_lock);
+    result = vm_fault_locked(as, faulttype, faultaddress, &exclusive);
+    rwlock_release_write(as->as_lock);
+  }
+
+  return result;
+}
+
+/*
+ * Handle a fault in as, which is locked for reading if *exclusive is false
+ * and for writing if it is true. If the fault needs the lock for writing
+ * and doesn't have it, sets *exclusive and returns without doing anything.
+ */
+static int vm_fault_locked(struct addrspace * as, int faulttype,
+                           vaddr_t faultaddress, bool * exclusive) {
+  // Declare these variables for use later.
+  paddr_t paddr = 0;
+
   vaddr_t old_addr = faultaddress;
 
   // First align the fault address to the starting address of the page
@@ -330,7 +1045,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 
   // Try to find the physical address translation first.
   // If the page isn't found, then it will become 0.
-  struct segment_entry * seg = find_segment_from_vaddr(old_addr);
+  struct segment_entry * seg = find_segment(as, old_addr);
 
   // If a segment is not found, that means the vaddr given is out of the bounds
   // of the allocated regions and should return an error.
@@ -341,367 +1056,2578 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
   }
 
   // If fault address is valid, check if fault address is in Page Table
-  struct page_entry * page = find_page_on_segment(seg, faultaddress);
-
+  struct page_entry * page = pt_lookup(&as->as_pt, faultaddress);
 
   switch (faulttype) {
     case VM_FAULT_READ:
-        //kprintf("Reading page at 0x%x\n", faultaddress);
-      // If the page isn't found, there's something wrong and there is a
-      // segmentation fault.
-      if (page == NULL) {
-        //kprintf("Requested 0x%x, so adding page to cover 0x%x -> 0x%x.\n", old_addr, faultaddress, (faultaddress + PAGE_SIZE)-1);
-        // Allocate a new physical page
-        paddr = getppages(1, false);
+    case VM_FAULT_WRITE:
+      break;
 
-        // If a page cannot be acquired, then just say there's no memory...
-        if (paddr == 0) {
-          return ENOMEM;
-        }
+    // A write was attempted on a page mapped read-only, which means it is
+    // either CLEAN or shared copy-on-write.
+    case VM_FAULT_READONLY:
+      if (page == NULL) {
+        return EFAULT;
+      }
+      break;
 
-        // Create a new page entry to reference the physical page that was
-        // just requested.
-        page = (struct page_entry *) kmalloc(sizeof(struct page_entry));
-        // Set the values of the new page created.
-        page->ppage_n = paddr;
-        page->vpage_n = faultaddress;
-        page->state = CLEAN; // If a page is writable then assume it's dirty.
-        page->bitmap_disk_index = 0;
-        page->swap_lock = lock_create("swap_lock");
-        page->swap_state = MEMORY;
-        KASSERT(page->swap_lock != NULL);
+    default:
+      return EINVAL;
+  } // End of case switch
 
-        set_page_owner(page, paddr);
+  // Read-only segments (text, rodata) are mapped read-only, so this is the
+  // program writing to one
+  if (faulttype != VM_FAULT_READ && !seg->writeable) {
+    return EFAULT;
+  }
 
-        array_add(seg->page_table, page, NULL);
+  // Writing to an existing page. A shared page gets copied first, unless
+  // it is a page of a shared mapping or shared memory segment, where
+  // everybody is meant to see the write; otherwise the page's swap (or
+  // file) copy is about to become stale.
+  bool shared = seg->isShared && page != NULL &&
+                (page->text != NULL || seg->shm != NULL);
+  if (page != NULL && faulttype != VM_FAULT_READ) {
+    if (page->refcount > 1 && !shared) {
+      if (!*exclusive) {
+        *exclusive = true;
+        return 0;
+      }
+      page = page_cow_break(as, faultaddress, page);
+      if (page == NULL) {
+        return ENOMEM;
       }
+    } else {
+      page_set_dirty(as, page, shared);
+    }
+  }
 
-      // Set the physical page to the page's ppage.
-      paddr = page->ppage_n;
-      break;
+  // Pages of shared memory segments come from the segment, so that
+  // everybody attached to it gets the same ones
+  if (page == NULL && seg->shm != NULL) {
+    struct page_entry * shmpage =
+      shm_getpage(seg->shm, (faultaddress - seg->region_start) / PAGE_SIZE,
+                  as->as_swap_hint);
+    if (shmpage == NULL) {
+      return ENOMEM;
+    }
 
-    case VM_FAULT_WRITE:
-      // If no page, then create a new PTE and allocate a new physical page
-      // dynamically.
+    page = vm_fault_insert(as, faultaddress, shmpage);
+    if (page != shmpage) {
+      page_release(shmpage);
       if (page == NULL) {
+        return ENOMEM;
+      }
+    }
 
-        //kprintf("Requested 0x%x, so adding page to cover 0x%x -> 0x%x.\n", old_addr, faultaddress, (faultaddress + PAGE_SIZE)-1);
-        // Allocate a new physical page
-        paddr = getppages(1, false);
+    shared = true;
+    if (faulttype != VM_FAULT_READ) {
+      page_set_dirty(as, page, shared);
+    }
+  }
 
-        // If a page cannot be acquired, then just say there's no memory...
-        if (paddr == 0) {
-          return ENOMEM;
-        }
+  // Reading a page nobody has touched yet. If none of it comes from the
+  // executable it is all zeroes, so share the zero page until the first
+  // write gives the process its own.
+  if (page == NULL && faulttype == VM_FAULT_READ &&
+      !page_from_file(as, faultaddress)) {
+    page_share(zero_page);
+    page = vm_fault_insert(as, faultaddress, zero_page);
+    if (page != zero_page) {
+      page_release(zero_page);
+      if (page == NULL) {
+        return ENOMEM;
+      }
+    } else {
+      zero_page_maps++;
+    }
+  }
 
-        // Create a new page entry to reference the physical page that was
-        // just requested.
-        page = (struct page_entry *) kmalloc(sizeof(struct page_entry));
-        // Set the values of the new page created.
-        page->ppage_n = paddr;
-        page->vpage_n = faultaddress;
-        page->state = DIRTY; // If a page is writable then assume it's dirty.
-        page->bitmap_disk_index = 0;
-        page->swap_lock = lock_create("swap_lock");
-        KASSERT(page->swap_lock != NULL);
-        page->swap_state = MEMORY;
-        set_page_owner(page, paddr);
-
-        array_add(seg->page_table, page, NULL);
+  // Whole pages of text are shared with everyone else running the same
+  // executable. Pages of shared file mappings are shared with everyone
+  // mapping the file, wherever they map it, and may end past the end of
+  // the file. The page may not be resident yet; that gets taken care of
+  // below.
+  bool from_file = seg->file_vnode != NULL &&
+                   faultaddress >= seg->region_start &&
+                   (seg->isShared ?
+                     faultaddress < seg->region_start + seg->file_size :
+                     faultaddress + PAGE_SIZE <=
+                       seg->region_start + seg->file_size);
+  if (page == NULL && from_file && (!seg->writeable || seg->isShared)) {
+    off_t offset = seg->file_offset + (faultaddress - seg->region_start);
+    struct page_entry * text = textcache_get(seg->file_vnode, offset,
+                                             seg->isShared ?
+                                               TEXTCACHE_ANYWHERE :
+                                               faultaddress);
+    if (text == NULL) {
+      return ENOMEM;
+    }
 
-      } else {
-        // If it reaches here, that means the page is already available.
-        // Just grab the physical address translation from the page and put
-        // it in the paddr variable to add it to the TLB later.
-        paddr = page->ppage_n;
+    page = vm_fault_insert(as, faultaddress, text);
+    if (page != text) {
+      page_release(text);
+      if (page == NULL) {
+        return ENOMEM;
       }
+    }
 
+    shared = seg->isShared && page->text != NULL;
+    if (shared && faulttype != VM_FAULT_READ) {
+      page_set_dirty(as, page, shared);
+    }
+  }
 
-      break;
+  // If no page, then create a new PTE and allocate a new physical page
+  // dynamically.
+  if (page == NULL) {
+    struct page_entry * new_page;
 
-    // A write was attempted on a read only page, which is an error.
-    // That means the physical address on the TLB is dirty.
-    case VM_FAULT_READONLY:
-      // I don't know what to do here, so I'll just do the default case...
+    //kprintf("Requested 0x%x, so adding page to cover 0x%x -> 0x%x.\n", old_addr, faultaddress, (faultaddress + PAGE_SIZE)-1);
+    // Allocate a new physical page. It only needs zeroing if some of it
+    // doesn't come from the executable.
+    paddr = getppages(1, from_file ? VM_ALLOC_NOZERO : 0);
 
-    default:
-      return EINVAL;
-  } // End of case switch
+    // If a page cannot be acquired, then just say there's no memory...
+    if (paddr == 0) {
+      return ENOMEM;
+    }
 
-  // If the page is on disk
-  if (page->swap_state == DISK) {
+    // Page in whatever part of it the executable covers. Nobody else can
+    // see the page yet, so it doesn't need pinning while we sleep.
+    int result = page_read_file(as, faultaddress, paddr);
+    if (result) {
+      freeppage(paddr);
+      return result;
+    }
 
-    KASSERT(can_swap);
+    // Create a new page entry to reference the physical page that was
+    // just requested.
+    new_page = (struct page_entry *) kmalloc(sizeof(struct page_entry));
+    if (new_page == NULL) {
+      freeppage(paddr);
+      return ENOMEM;
+    }
 
-    // SWAP!
-    int error = swap_in(page);
-    KASSERT(error == 0);
+    // Set the values of the new page created. It has no copy in swap yet,
+    // so it starts out dirty.
+    new_page->ppage_n = paddr;
+    new_page->vpage_n = faultaddress;
+    new_page->state = DIRTY;
+    new_page->bitmap_disk_index = 0;
+    new_page->swap_hint = as->as_swap_hint;
+    new_page->swap_state = MEMORY;
+    new_page->refcount = 1;
+    new_page->pte = 0;
+    new_page->prefetched = false;
+    new_page->readahead = false;
+    new_page->locked = false;
+    new_page->text = NULL;
+
+    // Another thread may have faulted the page in while we were busy
+    page = vm_fault_insert(as, faultaddress, new_page);
+    if (page != new_page) {
+      kfree(new_page);
+      freeppage(paddr);
+      if (page == NULL) {
+        return ENOMEM;
+      }
+    } else {
+      // From here on the page can be picked for eviction
+      set_page_owner(page, paddr, as);
+    }
   }
 
-  // At this point the paddr needs to exist or else it would not have gotten
-  // this far.
-  if (paddr == 0) {
-    //kprintf("faulttype %d vaddr %x -> paddr %x\n", faulttype, faultaddress, paddr);
-  }
-  KASSERT(paddr != 0);
+  // Load the translation, bringing the page back in from swap first if it
+  // was evicted. An eviction can sneak in between swapping the page in and
+  // loading the TLB, in which case we just go around again.
+  bool prefetched = false;
+  while (!vm_tlb_load_resident(page, faultaddress, seg->writeable, shared,
+                               &prefetched)) {
 
-  // I believe this part attempts to find an available TLB page entry and caches
-  // it to the TLB.
-  /* Disable interrupts on this CPU while frobbing the TLB. */
-  spl = splhigh();
-  uint32_t ehi, elo;
-  int i;
+    KASSERT(can_swap || page->text != NULL);
 
-  for (i=0; i<NUM_TLB; i++) {
-    tlb_read(&ehi, &elo, i);
-    if (elo & TLBLO_VALID) {
-      continue;
+    // The page is read over the whole frame, so no need to zero it
+    paddr = getppages(1, VM_ALLOC_NOZERO);
+    if (paddr == 0) {
+      return ENOMEM;
+    }
+
+    // SWAP! Another process sharing the page may have beaten us to it.
+    if (swap_in(as, seg, page, paddr)) {
+      major_faults++;
+    } else {
+      freeppage(paddr);
     }
-    ehi = faultaddress;
-    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-    tlb_write(ehi, elo, i);
-    splx(spl);
-    return 0;
   }
 
-  // If the TLB is full, pick a random to evict
-  ehi = faultaddress;
-  elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-  tlb_random(ehi, elo);
+  // A prefetched page that gets used after all
+  if (prefetched) {
+    fa_used++;
+  }
+
+  vm_fault_around(as, seg, faultaddress);
+
+  // A sequential scan isn't coming back for the pages behind it
+  if (seg->advice == MADV_SEQUENTIAL &&
+      faultaddress >= seg->region_start + ADVICE_BEHIND * PAGE_SIZE) {
+    struct page_entry * behind =
+      pt_lookup(&as->as_pt, faultaddress - ADVICE_BEHIND * PAGE_SIZE);
+    if (behind != NULL && page_deactivate(behind)) {
+      advice_behind++;
+    }
+  }
 
-  splx(spl);
   return 0;
 }
 
 /*
- * Find a page entry on the provided segment. If it doesn't exist, it returns
- * NULL.
+ * Map page at vaddr in as, unless another fault got there first. Returns
+ * whatever page is mapped there now, or NULL if out of memory.
  */
-struct segment_entry * find_segment_from_vaddr(vaddr_t vaddr) {
-  // Make sure the process exists as we need to grab information from it.
-  struct addrspace * as = proc_getas();
-  KASSERT(as != NULL);
+static struct page_entry * vm_fault_insert(struct addrspace * as,
+                                           vaddr_t vaddr,
+                                           struct page_entry * page) {
+  lock_acquire(as->as_ptlock);
+
+  struct page_entry * mapped = pt_lookup(&as->as_pt, vaddr);
+  if (mapped == NULL) {
+    mapped = pt_insert(&as->as_pt, vaddr, page) ? NULL : page;
+  }
 
-  // Iterate the array to find if there is a match.
-  struct array * segs = as->segments_list;
-  unsigned int i;
-  for (i = 0; i < array_num(segs); i++) {
-    struct segment_entry * seg = array_get(segs, i);
-    if (seg->region_start <= vaddr &&
-        seg->region_start + seg->region_size > vaddr) {
-      return seg;
+  lock_release(as->as_ptlock);
+  return mapped;
+}
+
+/* Whether any of the page at vaddr comes from the executable */
+static bool page_from_file(struct addrspace * as, vaddr_t vaddr) {
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->file_vnode != NULL && seg->file_size > 0 &&
+        seg->region_start < vaddr + PAGE_SIZE &&
+        seg->region_start + seg->file_size > vaddr) {
+      return true;
     }
   }
-
-  return NULL;
+  return false;
 }
 
 /*
- * Find a page entry on the provided segment that contains the vaddr.
- * If it doesn't exist, it returns NULL.
+ * Read the parts of the executable that belong in the page at vaddr into
+ * the frame at paddr. More than one segment can share a page if they
+ * aren't page aligned, so look at all of them. The rest of the frame is
+ * left alone.
  */
-struct page_entry * find_page_on_segment(struct segment_entry * seg, vaddr_t vaddr) {
-  // Make sure the process exists as we need to grab information from it.
-  KASSERT(curproc != NULL);
-  KASSERT(seg != NULL);
+static int page_read_file(struct addrspace * as, vaddr_t vaddr,
+                          paddr_t paddr) {
+  struct iovec iov;
+  struct uio ku;
+
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->file_vnode == NULL) {
+      continue;
+    }
 
-  // Iterate the array to find if there is a match.
-  struct array * pages = seg->page_table;
-  unsigned int i;
-  for (i = 0; i < array_num(pages); i++) {
-    struct page_entry * page = array_get(pages, i);
-    if (((vaddr_t) (page->vpage_n)) == vaddr) {
-      return page;
+    // Overlap between the page and the file-backed part of the segment
+    vaddr_t start = seg->region_start > vaddr ? seg->region_start : vaddr;
+    vaddr_t end = seg->region_start + seg->file_size;
+    if (end > vaddr + PAGE_SIZE) {
+      end = vaddr + PAGE_SIZE;
+    }
+    if (start >= end) {
+      continue;
+    }
+
+    uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+              end - start, seg->file_offset + (start - seg->region_start),
+              UIO_READ);
+
+    int result = VOP_READ(seg->file_vnode, &ku);
+    if (result) {
+      return result;
+    }
+
+    // load_elf checked the file was long enough, so it got truncated since
+    if (ku.uio_resid != 0) {
+      return EIO;
     }
+
+    file_pages_read++;
   }
 
-  return NULL;
+  return 0;
 }
 
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-  bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
+/*
+ * Preload TLB entries for the resident pages around vaddr that the refill
+ * handler can't load by itself, adapting the window to how many of those
+ * turn out to be wasted. Concurrent faults in as can lose updates to the
+ * window counters, which only makes the window adapt a little slower.
+ */
+static void vm_fault_around(struct addrspace * as, struct segment_entry * seg,
+                            vaddr_t vaddr) {
+  if (fault_around_max == 0 || seg->advice == MADV_RANDOM) {
+    return;
+  }
 
+  if (as->as_fa_window == 0) {
+    if (as->as_fa_cooldown > 0) {
+      as->as_fa_cooldown--;
+      return;
+    }
+    as->as_fa_window = 1;
+  }
+  if (as->as_fa_window > fault_around_max) {
+    as->as_fa_window = fault_around_max;
+  }
 
-paddr_t getppages(unsigned long npages, bool isKernel) {
-  // Cycle through the pages, try to get space raw
-  // Could not get enough mem, time to swap!
+  unsigned int window = as->as_fa_window;
+  unsigned int loaded = 0;
+  vaddr_t seg_start = seg->region_start & PAGE_FRAME;
+  vaddr_t seg_end = seg->region_start + seg->region_size;
 
-  unsigned long count = 0;
+  spinlock_acquire(&resident_lock);
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_acquire(&coremap_lock);
+  /* Disable interrupts on this CPU while frobbing the TLB. */
+  int spl = splhigh();
+
+  uint32_t asid = tlb_cpus[curcpu->c_number].tc_current;
+
+  // Look ahead first, since that's the way scans usually go, then behind
+  for (int dir = 1; dir >= -1 && loaded < window; dir -= 2) {
+    for (unsigned int d = 1; d <= window && loaded < window; d++) {
+      vaddr_t va;
+      if (dir > 0) {
+        va = vaddr + d * PAGE_SIZE;
+        if (va >= seg_end || va < vaddr) {
+          break;
+        }
+      } else {
+        if (vaddr < seg_start + d * PAGE_SIZE) {
+          break;
+        }
+        va = vaddr - d * PAGE_SIZE;
+      }
+
+      struct page_entry * page = pt_lookup(&as->as_pt, va);
+      if (page == NULL || page == zero_page || page->pte != 0 ||
+          page->prefetched || page->swap_state != MEMORY) {
+        continue;
+      }
+
+      unsigned long index = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+      if (coremap[index].busy || coremap[index].owner != page) {
+        continue;
+      }
+
+      // Same permissions vm_tlb_load_resident would give it. Nothing will
+      // fault on the page while the entry is there, so count the prefetch
+      // as a use, or the replacement policy would take it for an idle page.
+      uint32_t ehi = va | (asid << TLBHI_PIDSHIFT);
+      uint32_t elo = page->ppage_n | TLBLO_VALID;
+      if (page->state == DIRTY && page->refcount == 1 && seg->writeable) {
+        elo |= TLBLO_DIRTY;
+      }
+      coremap[index].referenced = true;
+      coremap[index].last_use = vm_vtime;
+      page->pte = elo;
+
+      int i = tlb_probe(ehi, 0);
+      if (i >= 0) {
+        tlb_write(ehi, elo, i);
+      } else {
+        tlb_random(ehi, elo);
+      }
+
+      page->prefetched = true;
+      loaded++;
+    }
   }
 
-  for (unsigned long i=0; i<COREMAP_PAGES; i++) {
+  splx(spl);
+  spinlock_release(&resident_lock);
 
-    // Find a series of unallocated page that matches npages.
-    if (coremap[i].state == FREE) {
-      count++;  // Increment the count
-    } else {
-      count = 0;  // Reset the count
+  fa_prefetched += loaded;
+  as->as_fa_prefetched += loaded;
+
+  if (as->as_fa_prefetched < FAULT_AROUND_SAMPLE) {
+    return;
+  }
+
+  // Back off while more than half the prefetches get wasted, and open up
+  // again while less than a quarter do
+  if (as->as_fa_wasted * 2 > as->as_fa_prefetched) {
+    as->as_fa_window /= 2;
+    if (as->as_fa_window == 0) {
+      as->as_fa_cooldown = FAULT_AROUND_COOLDOWN;
     }
+  } else if (as->as_fa_wasted * 4 < as->as_fa_prefetched) {
+    as->as_fa_window *= 2;
+    if (as->as_fa_window > fault_around_max) {
+      as->as_fa_window = fault_around_max;
+    }
+  }
+  as->as_fa_prefetched = 0;
+  as->as_fa_wasted = 0;
+}
+
+int vm_setfaultaround(unsigned int pages) {
+  if (pages > FAULT_AROUND_MAX) {
+    return EINVAL;
+  }
 
-    // If we have what we need
-    if (count == npages) {
-      // Get the starting address
-      unsigned long page_num = i - (count - 1);
+  fault_around_max = pages;
+  return 0;
+}
 
-      // Calculate the physical address for the first page allocated.
-      paddr_t paddr = (page_num * PAGE_SIZE) + coremap_pagestartaddr;
-      KASSERT(paddr != 0);
+void vm_setreaper(unsigned int pages) {
+  reaper_threshold = pages;
+}
 
-      // Mark those pages as allocated
-      for (unsigned long j = 0; j < count; j++) {
-        // Set if the page is user or kernel
-        coremap[page_num + j].state = isKernel ? KERNEL : USER;
+int vm_setreadahead(unsigned int pages) {
+  if (pages > SWAP_IO_MAX - 1) {
+    return EINVAL;
+  }
 
-        // Initialize value for block_size for all pages.
-        coremap[page_num + j].block_size = 0;
+  swap_readahead = pages;
+  return 0;
+}
 
-        // Clear out the page
-        as_zero_region(((page_num + j) * PAGE_SIZE) + coremap_pagestartaddr, 1);
-      }
+/*
+ * Make a CLEAN page DIRTY and give up its swap slot. Does nothing if the page
+ * got evicted in the meantime; the fault will bring it back CLEAN and the
+ * write will simply fault again. Only pages of shared mappings and shared
+ * memory (shared is set) can be dirtied while shared. Those of shared file
+ * mappings have no slot; they get written back to their file instead.
+ *
+ * A private page that used to be shared copy-on-write is as's alone again,
+ * so eviction can go back to shooting down only as's CPUs.
+ */
+static void page_set_dirty(struct addrspace * as, struct page_entry * page,
+                           bool shared) {
+  page_lock(page);
+
+  KASSERT(page->refcount == 1 || shared);
+  if (page->swap_state == MEMORY && page->state == CLEAN) {
+    page->state = DIRTY;
+    if (page->text == NULL) {
+      zpool_drop(page->bitmap_disk_index);
+      swapmap_free(page->bitmap_disk_index);
+    }
+  }
 
-      // Remember to set the block_size for the first page
-      coremap[page_num].block_size = npages;
+  if (page->swap_state == MEMORY && !shared && page->text == NULL) {
+    unsigned long index = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+    spinlock_acquire(&resident_lock);
+    coremap[index].as = as;
+    spinlock_release(&resident_lock);
+  }
 
-      // If booted, then be atomic
-      if (vm_booted) {
-        spinlock_release(&coremap_lock);
+  page_unlock(page);
+}
+
+/*
+ * Give the current process its own copy of a page it shares copy-on-write
+ * at vaddr, replacing the shared page in as's page table. Returns the copy,
+ * or NULL if out of memory. as->as_lock is held for writing, so no other
+ * fault can be using the old page.
+ */
+static struct page_entry * page_cow_break(struct addrspace * as, vaddr_t vaddr,
+                                          struct page_entry * page) {
+  // A copy of the zero page is just a fresh zeroed page
+  bool zero = page == zero_page;
+  paddr_t paddr = getppages(1, zero ? 0 : VM_ALLOC_NOZERO);
+  if (paddr == 0) {
+    return NULL;
+  }
+
+  struct page_entry * copy = kmalloc(sizeof(struct page_entry));
+  if (copy == NULL) {
+    freeppage(paddr);
+    return NULL;
+  }
+
+  copy->ppage_n = paddr;
+  copy->vpage_n = vaddr;
+  copy->state = DIRTY;
+  copy->swap_state = MEMORY;
+  copy->bitmap_disk_index = 0;
+  copy->swap_hint = as->as_swap_hint;
+  copy->refcount = 1;
+  copy->pte = 0;
+  copy->prefetched = false;
+  copy->readahead = false;
+  copy->locked = false;
+  copy->text = NULL;
+
+  // Keep the shared page from being evicted while it's copied. If it is
+  // already on disk, read it straight from its swap slot (or the compressed
+  // pool), which can't go stale while the page is shared. Another sharer
+  // may swap it back in between the two, in which case try again.
+  if (zero) {
+    zero_page_copies++;
+  } else {
+    bool copied = false;
+    while (!copied) {
+      if (vm_page_pin(page)) {
+        memmove((void *)PADDR_TO_KVADDR(paddr),
+                (const void *)PADDR_TO_KVADDR(page->ppage_n), PAGE_SIZE);
+        vm_page_unpin(page);
+        copied = true;
+        continue;
       }
 
-      // Return the correct address
-      return paddr;
+      page_lock(page);
+      if (page->swap_state != MEMORY) {
+        KASSERT(page->state == CLEAN);
+        if (!zpool_read(page->bitmap_disk_index, paddr)) {
+          block_read(page->bitmap_disk_index, paddr);
+        }
+        copied = true;
+      }
+      page_unlock(page);
     }
   }
 
-  if (!can_swap) {
-    if (vm_booted) {
-      spinlock_release(&coremap_lock);
-    }
-    return 0;
+  // Swap the copy into our page table, and get rid of the old page's entries
+  // on the other CPUs we have run on, so that we never see it again
+  pt_replace(&as->as_pt, vaddr, copy);
+  vm_tlb_invalidate_range(as, vaddr, vaddr + PAGE_SIZE);
+
+  set_page_owner(copy, paddr, as);
+  page_release(page);
+  if (!zero) {
+    cow_copies++;
   }
 
-  // If not enough pages are found, swapout!
-  uint32_t random_page = random() % COREMAP_PAGES;
+  return copy;
+}
+
+/*
+ * If the page is resident, mark it referenced for the replacement policy and
+ * load its translation for vaddr into the TLB. Returns false if the page is on disk.
+ * Waits for an eviction of the page that is already under way to finish.
+ * The page is mapped read-only unless writeable is set. A page of a shared
+ * mapping is writeable even if others have it too (shared is set), but
+ * only through our own TLB entry. Sets *prefetched if fault-around had
+ * loaded the page and this is the first use of it we get to see.
+ */
+static bool vm_tlb_load_resident(struct page_entry * page, vaddr_t vaddr,
+                                 bool writeable, bool shared,
+                                 bool * prefetched) {
+  spinlock_acquire(&resident_lock);
 
-  while (coremap[random_page].state != USER) {
-    random_page = random() % COREMAP_PAGES;
+  coremap_wait_unbusy(page);
+
+  if (page->swap_state != MEMORY) {
+    spinlock_release(&resident_lock);
+    return false;
   }
 
-  KASSERT(coremap[random_page].state != KERNEL);
+  unsigned long index = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+  KASSERT(coremap[index].owner == page);
+  coremap[index].referenced = true;
+  coremap[index].last_use = vm_vtime;
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_release(&coremap_lock);
+  if (page->prefetched) {
+    page->prefetched = false;
+    *prefetched = true;
   }
 
-  int error = swap_out(coremap[random_page].owner);
-  KASSERT(error == 0);
+  if (page->readahead) {
+    page->readahead = false;
+    swap_ra_hits++;
+  }
 
-  paddr_t paddr = (random_page * PAGE_SIZE) + coremap_pagestartaddr;
-  KASSERT(can_swap);
+  // Only private dirty pages in writeable segments are writeable, so that
+  // writes to clean or shared ones fault
+  uint32_t ehi = vaddr |
+                 (tlb_cpus[curcpu->c_number].tc_current << TLBHI_PIDSHIFT);
+  uint32_t elo = page->ppage_n | TLBLO_VALID;
+  if (page->state == DIRTY && (page->refcount == 1 || shared) && writeable) {
+    elo |= TLBLO_DIRTY;
+  }
 
-  return paddr;
+  // From now on the refill handler can load it without asking us. That
+  // goes for everyone sharing the page, who might have it read-only.
+  page->pte = elo;
+  if (page->refcount > 1) {
+    page->pte &= ~TLBLO_DIRTY;
+  }
+
+  /* Disable interrupts on this CPU while frobbing the TLB. */
+  int spl = splhigh();
+
+  // Replace the existing (read-only) entry if there is one; the TLB must
+  // never hold two entries for the same page.
+  int i = tlb_probe(ehi, 0);
+  if (i >= 0) {
+    tlb_write(ehi, elo, i);
+    splx(spl);
+    spinlock_release(&resident_lock);
+    return true;
+  }
+
+  // Let the processor pick a slot, like the refill handler does
+  tlb_random(ehi, elo);
+
+  splx(spl);
+  spinlock_release(&resident_lock);
+  return true;
 }
 
+/* Throw out everything in this CPU's TLB. Called with interrupts off. */
+static void vm_tlb_flush(void) {
+  for (unsigned int i=0; i<NUM_TLB; i++) {
+    tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+  }
+  tlb_cpus[curcpu->c_number].tc_flushes++;
+}
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
-vaddr_t alloc_kpages(unsigned npages) {
+/*
+ * Carry out a shootdown on this CPU. Called with interrupts off.
+ */
+static void vm_tlb_shootdown_local(const struct tlbshootdown * ts) {
+  uint32_t ehi, elo;
+  struct tlb_cpu * tc = &tlb_cpus[curcpu->c_number];
 
-  // Get address for n physical pages
-  paddr_t addr = getppages(npages, true);
+  if (ts->ts_as != NULL) {
+    // Nothing to do unless the address space has a live ASID here
+    if (ts->ts_as->as_asid_gens[curcpu->c_number] != tc->tc_generation) {
+      return;
+    }
+    uint32_t asid = ts->ts_as->as_asids[curcpu->c_number];
 
-  // Make sure its valid
-  if (addr != 0) {
-    // Return the virtual kernel address
-    return PADDR_TO_KVADDR(addr);
+    if (ts->ts_npages == TLBSHOOTDOWN_ALL) {
+      for (unsigned int i=0; i<NUM_TLB; i++) {
+        tlb_read(&ehi, &elo, i);
+        if ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+          tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+      }
+    } else {
+      for (unsigned int p=0; p<ts->ts_npages; p++) {
+        ehi = (ts->ts_vaddrs[p] & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+        int i = tlb_probe(ehi, 0);
+        if (i >= 0) {
+          tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+      }
+    }
+  } else {
+    // We don't know which address spaces map the pages, so match any ASID.
+    // Pages mapped at different addresses don't even have one, and take
+    // everything with them.
+    for (unsigned int i=0; i<NUM_TLB; i++) {
+      tlb_read(&ehi, &elo, i);
+      for (unsigned int p=0; p<ts->ts_npages; p++) {
+        if ((ehi & TLBHI_VPAGE) == (ts->ts_vaddrs[p] & TLBHI_VPAGE) ||
+            ts->ts_vaddrs[p] == VPAGE_ANYWHERE) {
+          tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+          break;
+        }
+      }
+    }
   }
-  return 0;
+
+  // tlb_read, tlb_write and tlb_probe clobber the current ASID
+  tlb_setasid(tc->tc_current);
 }
 
-void freeppage(paddr_t paddr) {
-  unsigned long page_num = (paddr - coremap_pagestartaddr) / PAGE_SIZE;
+/*
+ * Carry out a shootdown on this CPU and on the other CPUs in cpus, and wait
+ * until all of them are done. Must not be called with a spinlock held.
+ */
+static void vm_tlb_shootdown(struct tlbshootdown * ts, uint32_t cpus) {
+  struct tlbshootdown_ack ack;
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_acquire(&coremap_lock);
+  spinlock_init(&ack.tsa_lock);
+  ts->ts_ack = &ack;
+
+  // Handle this CPU's part with interrupts off, so we can't move to another
+  // CPU before it is left out of the targets.
+  int spl = splhigh();
+
+  vm_tlb_shootdown_local(ts);
+
+  unsigned int cpu = curcpu->c_number;
+  cpus &= ~((uint32_t)1 << cpu);
+  if (num_cpus < 32) {
+    cpus &= ((uint32_t)1 << num_cpus) - 1;
   }
 
-  // Make sure that the page is actually allocated
-  KASSERT(coremap[page_num].state != FREE);
+  ack.tsa_pending = 0;
+  for (unsigned int i=0; i<num_cpus; i++) {
+    if (cpus & ((uint32_t)1 << i)) {
+      ack.tsa_pending++;
+    }
+  }
+  tlb_cpus[cpu].tc_sent += ack.tsa_pending;
 
-  // Free it
-  coremap[page_num].state = FREE;
-  coremap[page_num].block_size = 0;
+  splx(spl);
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_release(&coremap_lock);
+  // Send with interrupts back on: a target's queue may be full, and it
+  // can't drain while that CPU is waiting on ours with interrupts off. If
+  // we end up on one of the targets meanwhile, it just gets the IPI too.
+  if (ack.tsa_pending > 0) {
+    ipi_tlbshootdown_cpus(cpus, ts);
   }
 
+  spinlock_acquire(&ack.tsa_lock);
+  while (ack.tsa_pending > 0) {
+    spinlock_release(&ack.tsa_lock);
+    thread_yield();
+    spinlock_acquire(&ack.tsa_lock);
+  }
+  spinlock_release(&ack.tsa_lock);
+
+  spinlock_cleanup(&ack.tsa_lock);
 }
 
+/*
+ * Send the shootdowns the replacement policy has queued up for reference
+ * bits it cleared (see clear_referenced). Must not be called with a
+ * spinlock held.
+ */
+static void vm_tlb_sweep_flush(void) {
+  struct tlbshootdown ts;
+
+  spinlock_acquire(&resident_lock);
+  ts = sweep_ts;
+  uint32_t cpus = sweep_cpus;
+  sweep_ts.ts_npages = 0;
+  sweep_cpus = 0;
+  spinlock_release(&resident_lock);
+
+  if (ts.ts_npages > 0) {
+    vm_tlb_shootdown(&ts, cpus);
+  }
+}
 
-void free_kpages(vaddr_t addr) {
-  paddr_t raw_paddr = KVADDR_TO_PADDR(addr);
+void vm_tlb_invalidate_range(struct addrspace * as, vaddr_t start,
+                             vaddr_t end) {
+  struct tlbshootdown ts;
 
-  // 1) addr = (page_num * PAGE_SIZE) + coremap_pagestartaddr
-  // 2) addr - coremap_pagestartaddr = page_num * PAGE_SIZE
-  unsigned long page_num = (raw_paddr - coremap_pagestartaddr) / PAGE_SIZE;
+  ts.ts_as = as;
+  ts.ts_npages = 0;
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_acquire(&coremap_lock);
+  // Name the pages if they fit in one batch, otherwise drop everything
+  if ((end - start) / PAGE_SIZE <= TLBSHOOTDOWN_BATCH) {
+    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+      ts.ts_vaddrs[ts.ts_npages++] = vaddr;
+    }
+  } else {
+    ts.ts_npages = TLBSHOOTDOWN_ALL;
   }
 
-  // Make sure that the page is actually allocated
-  KASSERT(coremap[page_num].state != FREE);
+  vm_tlb_shootdown(&ts, as->as_cpus);
+}
 
+void vm_tlb_activate(struct addrspace * as) {
+  int spl = splhigh();
 
-  unsigned long blocks = coremap[page_num].block_size;
+  unsigned int cpu = curcpu->c_number;
+  struct tlb_cpu * tc = &tlb_cpus[cpu];
 
-  for (unsigned long offset = 0; offset < blocks; offset++) {
-    coremap[page_num + offset].state = FREE;
-    coremap[page_num + offset].block_size = 0;
+  if (as->as_asid_gens[cpu] != tc->tc_generation) {
+    if (tc->tc_next == NUM_ASIDS) {
+      // Out of ASIDs; forget all of them and start over
+      vm_tlb_flush();
+      tc->tc_generation++;
+      tc->tc_next = 1;
+      tc->tc_rollovers++;
+    }
+    as->as_asids[cpu] = tc->tc_next++;
+    as->as_asid_gens[cpu] = tc->tc_generation;
   }
 
+  // From now on our TLB may hold entries for it
+  as->as_cpus |= (uint32_t)1 << cpu;
 
-  // If booted, then be atomic
-  if (vm_booted) {
-    spinlock_release(&coremap_lock);
+  tc->tc_current = as->as_asids[cpu];
+  tlb_setasid(tc->tc_current);
+
+  splx(spl);
+}
+
+/*
+ * Find a page entry on the provided segment. If it doesn't exist, it returns
+ * NULL.
+ */
+struct segment_entry * find_segment_from_vaddr(vaddr_t vaddr) {
+  // Make sure the process exists as we need to grab information from it.
+  struct addrspace * as = proc_getas();
+  KASSERT(as != NULL);
+
+  return find_segment(as, vaddr);
+}
+
+/*
+ * Find the segment of as that vaddr is in, or NULL. The caller holds
+ * as->as_lock.
+ */
+struct segment_entry * find_segment(struct addrspace * as, vaddr_t vaddr) {
+  // Iterate the array to find if there is a match.
+  struct array * segs = as->segments_list;
+  unsigned int i;
+  for (i = 0; i < array_num(segs); i++) {
+    struct segment_entry * seg = array_get(segs, i);
+    if (seg->region_start <= vaddr &&
+        seg->region_start + seg->region_size > vaddr) {
+      return seg;
+    }
   }
 
+  return NULL;
 }
 
 /*
- * Return amount of memory (in bytes) used by allocated coremap pages.  If
- * there are ongoing allocations, this value could change after it is returned
- * to the caller. But it should have been correct at some point in time.
+ * Find a segment of as that overlaps [start, end), or NULL. The caller
+ * holds as->as_lock.
  */
-unsigned int coremap_used_bytes() {
-  unsigned count = 0;
-  for (unsigned i = 0; i < COREMAP_PAGES; ++i) {
-    if (coremap[i].state != FREE) ++count;
+struct segment_entry * find_segment_overlap(struct addrspace * as,
+                                            vaddr_t start, vaddr_t end) {
+  for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+    struct segment_entry * seg = array_get(as->segments_list, i);
+    if (seg->region_start < end &&
+        seg->region_start + seg->region_size > start) {
+      return seg;
+    }
   }
 
-  return count * PAGE_SIZE;
+  return NULL;
 }
 
-/* TLB shootdown handling called from interprocessor_interrupt */
-void vm_tlbshootdown(const struct tlbshootdown * shootdown) {
-  (void) shootdown;
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+  bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
-void set_page_owner(struct page_entry * page, paddr_t address) {
-  unsigned long page_num = (address - coremap_pagestartaddr) / PAGE_SIZE;
 
-  // Make sure that the page is actually allocated
-  KASSERT(coremap[page_num].state != FREE);
+/*
+ * Buddy allocator helpers. All of these expect coremap_lock to be held (or
+ * the VM to not be booted yet, in which case we are the only CPU running).
+ */
 
-  coremap[page_num].owner = page;
+/* Put the free block of 2^order pages starting at index on its free list */
+static void free_list_push(unsigned int index, unsigned int order) {
+  KASSERT(order <= COREMAP_MAX_ORDER);
+
+  coremap[index].free_head = true;
+  coremap[index].order = order;
+  coremap[index].prev = -1;
+  coremap[index].next = free_lists[order];
+
+  if (free_lists[order] != -1) {
+    coremap[free_lists[order]].prev = index;
+  }
+  free_lists[order] = index;
+}
+
+/* Take the free block starting at index off of its free list */
+static void free_list_remove(unsigned int index) {
+  KASSERT(coremap[index].free_head);
+
+  int next = coremap[index].next;
+  int prev = coremap[index].prev;
+
+  if (prev == -1) {
+    free_lists[coremap[index].order] = next;
+  } else {
+    coremap[prev].next = next;
+  }
+
+  if (next != -1) {
+    coremap[next].prev = prev;
+  }
+
+  coremap[index].free_head = false;
+  coremap[index].next = -1;
+  coremap[index].prev = -1;
+}
+
+/*
+ * Free a naturally aligned block of 2^order pages, merging it with its buddy
+ * for as long as the buddy is also a free block of the same order.
+ */
+static void coremap_free_block(unsigned int index, unsigned int order) {
+  while (order < COREMAP_MAX_ORDER) {
+    unsigned int buddy = index ^ (1U << order);
+
+    // The buddy has to exist and be a whole free block of the same size
+    if (buddy + (1U << order) > COREMAP_PAGES ||
+        !coremap[buddy].free_head || coremap[buddy].order != order) {
+      break;
+    }
+
+    free_list_remove(buddy);
+    if (buddy < index) {
+      index = buddy;
+    }
+    order++;
+  }
+
+  free_list_push(index, order);
+}
+
+/*
+ * Return count pages starting at index to the buddy allocator. The range
+ * doesn't need to be a power of two; it is carved into the largest aligned
+ * blocks that fit.
+ */
+static void coremap_free_range(unsigned int index, unsigned int count) {
+  KASSERT(index + count <= COREMAP_PAGES);
+
+  for (unsigned int i = 0; i < count; i++) {
+    coremap[index + i].state = FREE;
+    coremap[index + i].block_size = 0;
+    coremap[index + i].owner = NULL;
+  }
+  coremap_used_pages -= count;
+
+  while (count > 0) {
+    unsigned int order = 0;
+    while (order < COREMAP_MAX_ORDER &&
+           (index & (1U << order)) == 0 &&
+           (2U << order) <= count) {
+      order++;
+    }
+
+    coremap_free_block(index, order);
+    index += 1U << order;
+    count -= 1U << order;
+  }
+}
+
+/*
+ * Pull exactly npages contiguous pages out of the buddy allocator. The
+ * smallest block that fits is split down to size, and whatever is left over
+ * past npages is given straight back. Returns the coremap index of the first
+ * page, or -1 if no block is large enough.
+ */
+static int coremap_alloc_range(unsigned long npages) {
+  unsigned int order = 0;
+  while ((1UL << order) < npages) {
+    order++;
+  }
+
+  if (order > COREMAP_MAX_ORDER) {
+    return -1;
+  }
+
+  // Find the smallest order that has a free block
+  unsigned int found = order;
+  while (found <= COREMAP_MAX_ORDER && free_lists[found] == -1) {
+    found++;
+  }
+
+  if (found > COREMAP_MAX_ORDER) {
+    return -1;
+  }
+
+  unsigned int index = free_lists[found];
+  free_list_remove(index);
+
+  // Split the block, keeping the lower half and freeing the upper one
+  while (found > order) {
+    found--;
+    free_list_push(index + (1U << found), found);
+  }
+
+  for (unsigned long i = 0; i < (1UL << order); i++) {
+    coremap[index + i].state = KERNEL;
+  }
+  coremap_used_pages += 1U << order;
+
+  // Give back the tail of the block that the caller didn't ask for
+  if ((1UL << order) > npages) {
+    coremap_free_range(index + npages, (1U << order) - npages);
+  }
+
+  return index;
+}
+
+/*
+ * Take a single page from the current CPU's page cache, refilling the cache
+ * from the coremap if it is empty. Returns the coremap index of the page, or
+ * -1 if neither had anything left.
+ */
+static int page_cache_get(void) {
+  struct page_cache * pc = &page_caches[curcpu->c_number];
+  int index = -1;
+
+  spinlock_acquire(&pc->pc_lock);
+
+  if (pc->pc_count == 0) {
+    pc->pc_misses++;
+
+    // Refill a whole batch while we have the global lock anyway
+    spinlock_acquire(&coremap_lock);
+    while (pc->pc_count < PAGE_CACHE_BATCH) {
+      int page = coremap_alloc_range(1);
+      if (page == -1) {
+        break;
+      }
+      coremap[page].state = FREE;
+      pc->pc_pages[pc->pc_count++] = page;
+    }
+    spinlock_release(&coremap_lock);
+  } else {
+    pc->pc_hits++;
+  }
+
+  if (pc->pc_count > 0) {
+    index = pc->pc_pages[--pc->pc_count];
+  }
+
+  spinlock_release(&pc->pc_lock);
+  return index;
+}
+
+/*
+ * Give a single page back to the current CPU's page cache, draining a batch
+ * back to the coremap first if the cache is full.
+ */
+static void page_cache_put(unsigned int index) {
+  struct page_cache * pc = &page_caches[curcpu->c_number];
+
+  spinlock_acquire(&pc->pc_lock);
+
+  coremap[index].state = FREE;
+  coremap[index].block_size = 0;
+  coremap[index].owner = NULL;
+
+  if (pc->pc_count == PAGE_CACHE_SIZE) {
+    spinlock_acquire(&coremap_lock);
+    for (unsigned int i = 0; i < PAGE_CACHE_BATCH; i++) {
+      coremap_free_range(pc->pc_pages[--pc->pc_count], 1);
+    }
+    spinlock_release(&coremap_lock);
+    pc->pc_drains++;
+  }
+
+  pc->pc_pages[pc->pc_count++] = index;
+  pc->pc_frees++;
+
+  spinlock_release(&pc->pc_lock);
+}
+
+/*
+ * Return every page held in every CPU's cache to the coremap. This is only
+ * done when the coremap itself has run out, so that pages stranded on other
+ * CPUs can still be used (and merged into larger blocks).
+ */
+static void page_cache_drain_all(void) {
+  for (unsigned int i = 0; i < MAXCPUS; i++) {
+    struct page_cache * pc = &page_caches[i];
+
+    spinlock_acquire(&pc->pc_lock);
+    if (pc->pc_count > 0) {
+      spinlock_acquire(&coremap_lock);
+      while (pc->pc_count > 0) {
+        coremap_free_range(pc->pc_pages[--pc->pc_count], 1);
+      }
+      spinlock_release(&coremap_lock);
+      pc->pc_drains++;
+    }
+    spinlock_release(&pc->pc_lock);
+  }
+}
+
+/* Allocate npages straight from the buddy allocator */
+static int coremap_get(unsigned long npages) {
+  // If booted, then be atomic
+  if (vm_booted) {
+    spinlock_acquire(&coremap_lock);
+  }
+
+  int index = coremap_alloc_range(npages);
+
+  if (vm_booted) {
+    spinlock_release(&coremap_lock);
+  }
+
+  return index;
+}
+
+/*
+ * Resident queue helpers. Called with resident_lock held.
+ */
+static void resident_append(unsigned int index) {
+  KASSERT(!coremap[index].resident);
+
+  coremap[index].resident = true;
+  coremap[index].next = -1;
+  coremap[index].prev = resident_tail;
+
+  if (resident_tail == -1) {
+    resident_head = index;
+  } else {
+    coremap[resident_tail].next = index;
+  }
+  resident_tail = index;
+  resident_count++;
+}
+
+static void resident_prepend(unsigned int index) {
+  KASSERT(!coremap[index].resident);
+
+  coremap[index].resident = true;
+  coremap[index].next = resident_head;
+  coremap[index].prev = -1;
+
+  if (resident_head == -1) {
+    resident_tail = index;
+  } else {
+    coremap[resident_head].prev = index;
+  }
+  resident_head = index;
+  resident_count++;
+}
+
+static void resident_unlink(unsigned int index) {
+  KASSERT(coremap[index].resident);
+
+  int next = coremap[index].next;
+  int prev = coremap[index].prev;
+
+  if (prev == -1) {
+    resident_head = next;
+  } else {
+    coremap[prev].next = next;
+  }
+
+  if (next == -1) {
+    resident_tail = prev;
+  } else {
+    coremap[next].prev = prev;
+  }
+
+  coremap[index].resident = false;
+  coremap[index].next = -1;
+  coremap[index].prev = -1;
+  resident_count--;
+}
+
+/* Move the page at the head of the queue to the tail (advance the hand) */
+static void resident_rotate(void) {
+  int index = resident_head;
+  resident_unlink(index);
+  resident_append(index);
+}
+
+/*
+ * Sleep until an eviction or pin of page's frame is over, if the page is
+ * resident. The page may go out and come back in another frame while we
+ * sleep, so its frame is looked up again every time around. Called with
+ * resident_lock held.
+ */
+static void coremap_wait_unbusy(struct page_entry * page) {
+  while (page->swap_state == MEMORY) {
+    unsigned long index = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+    if (!coremap[index].busy || coremap[index].owner != page) {
+      return;
+    }
+    wchan_sleep(evict_wchan, &resident_lock);
+  }
+}
+
+/*
+ * Clear a page's reference bit, making its next access fault. Its entry in
+ * this CPU's TLB goes right away. Other CPUs that may have one are sent a
+ * shootdown once resident_lock is let go (see vm_tlb_sweep_flush); a page
+ * that would need one when that batch is already full keeps its bit this
+ * time around. Returns whether the bit got cleared.
+ *
+ * Pages mapped at different addresses (shm and shared file mappings) have
+ * no one address a shootdown could name, and would take whole TLBs with
+ * them. They only lose the bit and their pte, so that the next refill
+ * faults; uses through TLB entries already loaded go unseen until then.
+ */
+static bool clear_referenced(unsigned int index) {
+  struct page_entry * page = coremap[index].owner;
+  struct addrspace * as = coremap[index].as;
+  uint32_t self = (uint32_t)1 << curcpu->c_number;
+  struct tlbshootdown ts;
+
+  if (page->vpage_n == VPAGE_ANYWHERE) {
+    coremap[index].referenced = false;
+    page->pte = 0;
+    return true;
+  }
+
+  // Pages nobody owns alone may be in any TLB
+  uint32_t all = num_cpus < 32 ? ((uint32_t)1 << num_cpus) - 1 : ~(uint32_t)0;
+  uint32_t others = (as == NULL ? all : as->as_cpus) & ~self;
+  if (others != 0) {
+    if (sweep_ts.ts_npages == TLBSHOOTDOWN_BATCH) {
+      sweep_skipped++;
+      return false;
+    }
+
+    // The address space may be gone by the time the shootdown goes out, so
+    // it matches the page in any address space on those CPUs
+    sweep_ts.ts_vaddrs[sweep_ts.ts_npages++] = page->vpage_n;
+    sweep_cpus |= others;
+  }
+
+  coremap[index].referenced = false;
+  page->pte = 0;
+
+  ts.ts_as = as;
+  ts.ts_npages = 1;
+  ts.ts_vaddrs[0] = page->vpage_n;
+
+  int spl = splhigh();
+  vm_tlb_shootdown_local(&ts);
+  splx(spl);
+
+  return true;
+}
+
+/* FIFO: evict whatever has been resident the longest */
+static int fifo_victim(void) {
+  if (resident_head != -1) {
+    evict_scanned++;
+  }
+  return resident_head;
+}
+
+/*
+ * Clock (second chance): referenced pages get their bit cleared and go to
+ * the back of the queue; the first unreferenced page is the victim.
+ */
+static int clock_victim(void) {
+  // Every page whose bit gets cleared can only be passed over once, so two
+  // laps nearly always find one
+  for (unsigned int n = 0; n < 2 * resident_count; n++) {
+    int index = resident_head;
+    evict_scanned++;
+
+    if (!coremap[index].referenced) {
+      return index;
+    }
+
+    clear_referenced(index);
+    resident_rotate();
+  }
+
+  return resident_head;
+}
+
+/*
+ * WSClock: like clock, but a page is only a victim once it hasn't been
+ * used for wsclock_tau faults. Among those, clean pages are preferred since
+ * they are cheapest to get rid of. If everything is in a working set, this
+ * degrades to plain clock.
+ */
+static int wsclock_victim(void) {
+  int candidate = -1;
+
+  for (unsigned int n = 0; n < resident_count; n++) {
+    int index = resident_head;
+    evict_scanned++;
+
+    if (coremap[index].referenced) {
+      clear_referenced(index);
+      coremap[index].last_use = vm_vtime;
+    } else if (vm_vtime - coremap[index].last_use > wsclock_tau) {
+      // Clean pages can be dropped without writing them out
+      if (coremap[index].owner->state == CLEAN) {
+        return index;
+      }
+      if (candidate == -1) {
+        candidate = index;
+      }
+    }
+
+    resident_rotate();
+  }
+
+  if (candidate != -1) {
+    return candidate;
+  }
+
+  return clock_victim();
+}
+
+/*
+ * Shoot down the TLB entries for n pages about to be evicted, one shootdown
+ * per owning address space, sent only to the CPUs it has run on. Pages
+ * without an owner (NULL in owners) may be mapped anywhere, so every CPU
+ * has to look for those. The owners can't go away meanwhile: tearing down
+ * an address space waits for the eviction of its pages to finish.
+ */
+static void vm_tlb_shootdown_evicted(struct page_entry ** pages,
+                                     struct addrspace ** owners,
+                                     unsigned int n) {
+  bool done[TLBSHOOTDOWN_BATCH];
+  struct tlbshootdown ts;
+
+  for (unsigned int i = 0; i < n; i++) {
+    done[i] = false;
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    if (done[i]) {
+      continue;
+    }
+
+    ts.ts_as = owners[i];
+    ts.ts_npages = 0;
+    for (unsigned int j = i; j < n; j++) {
+      if (!done[j] && owners[j] == ts.ts_as) {
+        ts.ts_vaddrs[ts.ts_npages++] = pages[j]->vpage_n;
+        done[j] = true;
+      }
+    }
+
+    if (ts.ts_as == NULL) {
+      evict_broadcasts++;
+      vm_tlb_shootdown(&ts, ~(uint32_t)0);
+    } else {
+      vm_tlb_shootdown(&ts, ts.ts_as->as_cpus);
+    }
+  }
+}
+
+/*
+ * Evict up to max user pages chosen by the replacement policy to swap, with
+ * one TLB shootdown for each address space they belong to. Fills in victims with the coremap
+ * indexes of the now unowned frames and returns how many there are.
+ *
+ * Dirty pages of shared file mappings are only evicted if write_files is
+ * set. Writing to a file takes the file system's locks, which whoever is
+ * allocating memory might be holding, so only the pageout daemon does it.
+ */
+static unsigned int coremap_evict_batch(int * victims, unsigned int max,
+                                        bool write_files) {
+  struct page_entry * pages[TLBSHOOTDOWN_BATCH];
+  struct addrspace * owners[TLBSHOOTDOWN_BATCH];
+  unsigned int n = 0;
+  unsigned int skipped = 0;
+
+  KASSERT(max <= TLBSHOOTDOWN_BATCH);
+
+  spinlock_acquire(&resident_lock);
+
+  while (n < max) {
+    int victim = vm_policy->vp_victim();
+    if (victim == -1) {
+      break;
+    }
+
+    struct page_entry * page = coremap[victim].owner;
+    KASSERT(page != NULL);
+    KASSERT(coremap[victim].state == USER);
+
+    // Leave it to the pageout daemon, and give up if that is all there is
+    if (!write_files && page->text != NULL && page->state == DIRTY) {
+      if (++skipped > resident_count) {
+        break;
+      }
+      resident_unlink(victim);
+      resident_append(victim);
+      continue;
+    }
+
+    resident_unlink(victim);
+    coremap[victim].busy = true;
+    page->pte = 0;
+    if (page->prefetched) {
+      // Going without ever having been used. The owner can't go away while
+      // its page is resident.
+      page->prefetched = false;
+      fa_wasted++;
+      if (coremap[victim].as != NULL) {
+        coremap[victim].as->as_fa_wasted++;
+      }
+    }
+    if (page->readahead) {
+      page->readahead = false;
+      swap_ra_wasted++;
+    }
+
+    victims[n] = victim;
+    pages[n] = page;
+    owners[n] = coremap[victim].as;
+    n++;
+  }
+
+  spinlock_release(&resident_lock);
+
+  // Reference bits cleared while looking for victims
+  vm_tlb_sweep_flush();
+
+  if (n == 0) {
+    return 0;
+  }
+
+  // Make sure nobody writes to the pages while they are being copied out
+  vm_tlb_shootdown_evicted(pages, owners, n);
+
+  int errors[TLBSHOOTDOWN_BATCH];
+  swap_out_batch(pages, n, errors, write_files);
+
+  unsigned int evicted = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    int victim = victims[i];
+
+    spinlock_acquire(&resident_lock);
+
+    coremap[victim].busy = false;
+    if (errors[i]) {
+      // Out of swap, or dirtied since; the page stays where it was
+      resident_append(victim);
+    } else {
+      coremap[victim].owner = NULL;
+      evict_count++;
+      victims[evicted++] = victim;
+    }
+
+    wchan_wakeall(evict_wchan, &resident_lock);
+    spinlock_release(&resident_lock);
+  }
+
+  return evicted;
+}
+
+/*
+ * Evict a single page. Returns the coremap index of the now unowned frame,
+ * or -1 if nothing could be evicted.
+ */
+static int coremap_evict(void) {
+  int victim;
+
+  if (coremap_evict_batch(&victim, 1, false) == 0) {
+    return -1;
+  }
+  return victim;
+}
+
+/*
+ * Number of pages nobody is using, counting the ones parked in the per-CPU
+ * caches.
+ */
+static unsigned int coremap_free_pages(void) {
+  return COREMAP_PAGES - coremap_used_bytes() / PAGE_SIZE;
+}
+
+/* Kick the pageout daemon if memory is getting low */
+static void pageout_wake(void) {
+  if (!can_swap || resident_count == 0) {
+    return;
+  }
+
+  // Cheap check first, leaving out the pages in the per-CPU caches and the
+  // zero pool. The daemon looks at the real number once it is up.
+  if (COREMAP_PAGES - coremap_used_pages < pageout_low) {
+    spinlock_acquire(&pageout_lock);
+    wchan_wakeone(pageout_wchan, &pageout_lock);
+    spinlock_release(&pageout_lock);
+  }
+}
+
+/*
+ * The pageout daemon. Sleeps until free memory drops below the low
+ * watermark, then evicts pages until it is back above the high one or
+ * there is nothing left to evict. In that last case the watermark is still
+ * crossed, so it waits a while before looking again.
+ */
+static void pageout_thread(void * unused1, unsigned long unused2) {
+  (void) unused1;
+  (void) unused2;
+
+  for (;;) {
+    spinlock_acquire(&pageout_lock);
+    while (resident_count == 0 || coremap_free_pages() >= pageout_low) {
+      wchan_sleep(pageout_wchan, &pageout_lock);
+    }
+    spinlock_release(&pageout_lock);
+
+    pageout_wakeups++;
+
+    unsigned int free;
+    while ((free = coremap_free_pages()) < pageout_high) {
+      unsigned long scanned = evict_scanned;
+      unsigned long writes = swap_writes;
+      int victims[TLBSHOOTDOWN_BATCH];
+
+      // Evict a batch at a time to share the TLB shootdowns
+      unsigned int want = pageout_high - free;
+      if (want > TLBSHOOTDOWN_BATCH) {
+        want = TLBSHOOTDOWN_BATCH;
+      }
+
+      unsigned int n = coremap_evict_batch(victims, want, true);
+      pageout_scanned += evict_scanned - scanned;
+      pageout_laundered += swap_writes - writes;
+      if (n == 0) {
+        pageout_stalls++;
+        clocksleep(PAGEOUT_BACKOFF);
+        break;
+      }
+
+      // Give the frames straight back to the buddy allocator
+      spinlock_acquire(&coremap_lock);
+      for (unsigned int i = 0; i < n; i++) {
+        coremap_free_range(victims[i], 1);
+      }
+      spinlock_release(&coremap_lock);
+      pageout_freed += n;
+    }
+  }
+}
+
+int vm_setwatermarks(unsigned int low, unsigned int high) {
+  if (low == 0 || low >= high || high > COREMAP_PAGES) {
+    return EINVAL;
+  }
+
+  pageout_low = low;
+  pageout_high = high;
+
+  // The new low watermark may already be crossed
+  pageout_wake();
+
+  return 0;
+}
+
+paddr_t getppages(unsigned long npages, int flags) {
+  // Try the pool of zeroed pages when zeroes are wanted, then this CPU's
+  // page cache, then the buddy allocator, then the pages sitting in every
+  // other CPU's cache and the zero pool.
+  // Could not get enough mem, time to swap!
+
+  int index = -1;
+  bool zeroed = false;
+  bool isKernel = (flags & VM_ALLOC_KERNEL) != 0;
+
+  if (vm_booted && npages == 1 && !(flags & VM_ALLOC_NOZERO)) {
+    index = zero_pool_get();
+    zeroed = index != -1;
+  }
+
+  if (index == -1 && vm_booted && npages == 1) {
+    index = page_cache_get();
+  }
+
+  if (index == -1) {
+    index = coremap_get(npages);
+  }
+
+  if (index == -1 && vm_booted && !(flags & VM_ALLOC_NOEVICT)) {
+    page_cache_drain_all();
+    zero_pool_drain();
+    index = coremap_get(npages);
+  }
+
+  if (vm_booted) {
+    pageout_wake();
+  }
+
+  if (index != -1) {
+    unsigned long page_num = index;
+
+    // Calculate the physical address for the first page allocated.
+    paddr_t paddr = (page_num * PAGE_SIZE) + coremap_pagestartaddr;
+    KASSERT(paddr != 0);
+
+    // Mark those pages as allocated. They are ours alone at this point, so
+    // this doesn't need coremap_lock.
+    for (unsigned long j = 0; j < npages; j++) {
+      // Set if the page is user or kernel
+      coremap[page_num + j].state = isKernel ? KERNEL : USER;
+
+      // Initialize value for block_size for all pages.
+      coremap[page_num + j].block_size = 0;
+      coremap[page_num + j].owner = NULL;
+    }
+
+    // Remember to set the block_size for the first page
+    coremap[page_num].block_size = npages;
+
+    // Clear out the pages
+    if (!zeroed && !(flags & VM_ALLOC_NOZERO)) {
+      as_zero_region(paddr, npages);
+    }
+
+    // Return the correct address
+    return paddr;
+  }
+
+  // Only single pages can be made by evicting a user page
+  if (!can_swap || npages != 1 || (flags & VM_ALLOC_NOEVICT)) {
+    return 0;
+  }
+
+  // If not enough pages are found, swapout!
+  int victim = coremap_evict();
+  if (victim == -1) {
+    return 0;
+  }
+
+  // The page now belongs to the caller
+  coremap[victim].state = isKernel ? KERNEL : USER;
+  coremap[victim].block_size = 1;
+  coremap[victim].owner = NULL;
+
+  paddr_t paddr = (victim * PAGE_SIZE) + coremap_pagestartaddr;
+  KASSERT(can_swap);
+
+  if (!(flags & VM_ALLOC_NOZERO)) {
+    as_zero_region(paddr, 1);
+  }
+
+  return paddr;
+}
+
+/*
+ * Take a page from the zero pool, or return -1 if it is empty. Wakes the
+ * pagezero thread when the pool gets low.
+ */
+static int zero_pool_get(void) {
+  int index = -1;
+
+  spinlock_acquire(&zero_lock);
+
+  if (zero_count > 0) {
+    index = zero_pages[--zero_count];
+    zero_reserved--;
+    zero_hits++;
+  } else {
+    zero_misses++;
+  }
+
+  if (zero_count < ZERO_POOL_LOW) {
+    wchan_wakeone(zero_wchan, &zero_lock);
+  }
+
+  spinlock_release(&zero_lock);
+  return index;
+}
+
+/* Give every page in the zero pool back to the buddy allocator */
+static void zero_pool_drain(void) {
+  spinlock_acquire(&zero_lock);
+  spinlock_acquire(&coremap_lock);
+
+  while (zero_count > 0) {
+    coremap_free_range(zero_pages[--zero_count], 1);
+    zero_reserved--;
+  }
+
+  spinlock_release(&coremap_lock);
+  spinlock_release(&zero_lock);
+}
+
+/*
+ * The pagezero thread. Keeps the zero pool topped up, but only while there
+ * is memory to spare, so that it never pushes the system into paging.
+ */
+static void pagezero_thread(void * unused1, unsigned long unused2) {
+  (void) unused1;
+  (void) unused2;
+
+  for (;;) {
+    spinlock_acquire(&zero_lock);
+    while (zero_count >= ZERO_POOL_LOW) {
+      wchan_sleep(zero_wchan, &zero_lock);
+    }
+    spinlock_release(&zero_lock);
+
+    while (zero_count < ZERO_POOL_SIZE &&
+           coremap_free_pages() > pageout_high + ZERO_POOL_SIZE) {
+
+      spinlock_acquire(&coremap_lock);
+      int index = coremap_alloc_range(1);
+      if (index != -1) {
+        coremap[index].state = FREE;
+        zero_reserved++;
+      }
+      spinlock_release(&coremap_lock);
+
+      if (index == -1) {
+        break;
+      }
+
+      as_zero_region((index * PAGE_SIZE) + coremap_pagestartaddr, 1);
+
+      spinlock_acquire(&zero_lock);
+      if (zero_count < ZERO_POOL_SIZE) {
+        zero_pages[zero_count++] = index;
+        index = -1;
+        zero_filled++;
+      }
+      spinlock_release(&zero_lock);
+
+      // Somebody else filled the pool in the meantime
+      if (index != -1) {
+        spinlock_acquire(&coremap_lock);
+        coremap_free_range(index, 1);
+        zero_reserved--;
+        spinlock_release(&coremap_lock);
+      }
+
+      // Let anything else that wants the CPU run first
+      thread_yield();
+    }
+
+    // Don't spin when memory is too tight to fill the pool; wait for the
+    // next allocation to come by instead.
+    if (zero_count < ZERO_POOL_LOW) {
+      spinlock_acquire(&zero_lock);
+      wchan_sleep(zero_wchan, &zero_lock);
+      spinlock_release(&zero_lock);
+    }
+  }
+}
+
+
+/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+vaddr_t alloc_kpages(unsigned npages) {
+
+  // Get address for n physical pages
+  paddr_t addr = getppages(npages, VM_ALLOC_KERNEL);
+
+  // Make sure its valid
+  if (addr != 0) {
+    // Return the virtual kernel address
+    return PADDR_TO_KVADDR(addr);
+  }
+  return 0;
+}
+
+void freeppage(paddr_t paddr) {
+  unsigned long page_num = (paddr - coremap_pagestartaddr) / PAGE_SIZE;
+
+  // Make sure that the page is actually allocated
+  KASSERT(coremap[page_num].state != FREE);
+
+  // A user page has to come off the resident queue first
+  if (coremap[page_num].state == USER) {
+    spinlock_acquire(&resident_lock);
+    KASSERT(!coremap[page_num].busy);
+    if (coremap[page_num].resident) {
+      resident_unlink(page_num);
+    }
+    spinlock_release(&resident_lock);
+  }
+
+  // Once booted, single pages go back through this CPU's cache
+  if (vm_booted) {
+    page_cache_put(page_num);
+    return;
+  }
+
+  // Free it
+  coremap_free_range(page_num, 1);
+}
+
+
+void free_kpages(vaddr_t addr) {
+  paddr_t raw_paddr = KVADDR_TO_PADDR(addr);
+
+  // 1) addr = (page_num * PAGE_SIZE) + coremap_pagestartaddr
+  // 2) addr - coremap_pagestartaddr = page_num * PAGE_SIZE
+  unsigned long page_num = (raw_paddr - coremap_pagestartaddr) / PAGE_SIZE;
+
+  // Make sure that the page is actually allocated
+  KASSERT(coremap[page_num].state != FREE);
+
+  unsigned long blocks = coremap[page_num].block_size;
+  KASSERT(blocks > 0);
+
+  // Single pages go back through this CPU's cache
+  if (vm_booted && blocks == 1) {
+    page_cache_put(page_num);
+    return;
+  }
+
+  // If booted, then be atomic
+  if (vm_booted) {
+    spinlock_acquire(&coremap_lock);
+  }
+
+  // Hand the whole allocation back, merging with any free buddies
+  coremap_free_range(page_num, blocks);
+
+
+  // If booted, then be atomic
+  if (vm_booted) {
+    spinlock_release(&coremap_lock);
+  }
+
+}
+
+/*
+ * Return amount of memory (in bytes) used by allocated coremap pages.  If
+ * there are ongoing allocations, this value could change after it is returned
+ * to the caller. But it should have been correct at some point in time.
+ */
+unsigned int coremap_used_bytes() {
+  // Pages parked in the per-CPU caches and the zero pool are free as far as
+  // anyone else is concerned. Holding coremap_lock keeps pages that are
+  // moving into a cache or the pool from being counted twice.
+  spinlock_acquire(&coremap_lock);
+
+  unsigned int cached = zero_reserved;
+  for (unsigned int i = 0; i < MAXCPUS; i++) {
+    cached += page_caches[i].pc_count;
+  }
+  unsigned int used = coremap_used_pages - cached;
+
+  spinlock_release(&coremap_lock);
+
+  return used * PAGE_SIZE;
+}
+
+/*
+ * Print VM statistics for the vmstat menu command.
+ */
+void vm_printstats() {
+  unsigned long hits = 0, misses = 0, frees = 0, drains = 0;
+
+  kprintf("Coremap: %u pages, %u in use\n", COREMAP_PAGES,
+          coremap_used_bytes() / PAGE_SIZE);
+  kprintf("Metadata: %u bytes per resident page (%u page entry, "
+          "%u coremap entry)\n",
+          sizeof(struct page_entry) + sizeof(struct coremap_page),
+          sizeof(struct page_entry), sizeof(struct coremap_page));
+
+  kprintf("Per-CPU page caches:\n");
+  kprintf("  cpu   cached       hits     misses      frees     drains\n");
+  for (unsigned int i = 0; i < num_cpus; i++) {
+    struct page_cache * pc = &page_caches[i];
+    kprintf("  %3u %8u %10lu %10lu %10lu %10lu\n", i, pc->pc_count,
+            pc->pc_hits, pc->pc_misses, pc->pc_frees, pc->pc_drains);
+    hits += pc->pc_hits;
+    misses += pc->pc_misses;
+    frees += pc->pc_frees;
+    drains += pc->pc_drains;
+  }
+  kprintf("  all %8s %10lu %10lu %10lu %10lu\n", "", hits, misses, frees,
+          drains);
+
+  kprintf("Zero pool: %u pages, %lu hits, %lu misses, %lu pages zeroed\n",
+          zero_count, zero_hits, zero_misses, zero_filled);
+
+  kprintf("Page replacement: %s (WSClock tau %lu)\n", vm_policy->vp_name,
+          wsclock_tau);
+  kprintf("  %u resident user pages, %lu faults, %lu evictions, "
+          "%lu pages scanned, %lu broadcast shootdowns, %lu bits left set\n",
+          resident_count, vm_vtime, evict_count, evict_scanned,
+          evict_broadcasts, sweep_skipped);
+
+  // Fault rate since the last time we were asked
+  struct timespec now, elapsed;
+  gettime(&now);
+  timespec_sub(&now, &vmstat_last_time, &elapsed);
+  uint64_t msecs = (uint64_t)elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+  unsigned long faults = vm_vtime - vmstat_last_faults;
+  unsigned long rate = msecs == 0 ? 0 :
+                       (unsigned long)((uint64_t)faults * 1000 / msecs);
+  vmstat_last_time = now;
+  vmstat_last_faults = vm_vtime;
+
+  kprintf("Faults: %lu per second over the last %lu.%03u seconds\n", rate,
+          (unsigned long)elapsed.tv_sec,
+          (unsigned)(elapsed.tv_nsec / 1000000));
+  kprintf("  %lu faults needed the address space locked for writing\n",
+          fault_exclusive);
+
+  // Out of the prefetches that have turned out one way or the other
+  unsigned long fa_hit = fa_used + fa_wasted == 0 ? 0 :
+                         fa_used * 100 / (fa_used + fa_wasted);
+  kprintf("Fault-around: up to %u pages, %lu prefetched, %lu used, "
+          "%lu evicted unused (%lu%% hit rate)\n", fault_around_max,
+          fa_prefetched, fa_used, fa_wasted, fa_hit);
+
+  kprintf("Swap: %lu pages read, %lu written, %lu clean evictions\n",
+          swap_reads, swap_writes, swap_clean_evictions);
+  unsigned long ra_hit = swap_ra_reads == 0 ? 0 :
+                         swap_ra_hits * 100 / swap_ra_reads;
+  kprintf("Swap clustering: %lu writes (%lu pages each on average), "
+          "up to %u pages read ahead, %lu read ahead, %lu used, "
+          "%lu evicted unused (%lu%% hit rate)\n", swap_write_ios,
+          swap_write_ios == 0 ? 0 : swap_writes / swap_write_ios,
+          swap_readahead, swap_ra_reads, swap_ra_hits, swap_ra_wasted, ra_hit);
+  kprintf("Copy-on-write: %lu pages copied\n", cow_copies);
+  kprintf("Zero page: %lu read faults mapped it, %lu written to\n",
+          zero_page_maps, zero_page_copies);
+  kprintf("Executables: %lu page reads\n", file_pages_read);
+  kprintf("Load control: %s, %lu faults from swap, %lu suspensions, "
+          "%lu resumptions, %u suspended now\n",
+          loadctl_enabled ? "on" : "off", major_faults, lc_suspensions,
+          lc_resumptions, lc_suspended);
+  kprintf("Advice: %lu pages dropped behind sequential scans, %lu pages "
+          "prefetched, %lu ranges discarded\n", advice_behind,
+          advice_willneed, advice_dontneed);
+  kprintf("Page freeing: %lu batches (%lu pages each on average), "
+          "%lu address spaces (%lu pages) reaped in the background "
+          "(threshold %u pages, 0 is off)\n",
+          free_batches, free_batches == 0 ? 0 : free_batch_pages / free_batches,
+          reaper_spaces, reaper_pages, reaper_threshold);
+  textcache_printstats();
+  shm_printstats();
+  if (can_swap) {
+    swapmap_printstats();
+    zpool_printstats();
+  }
+
+  unsigned long sent = 0, received = 0, rollovers = 0, flushes = 0;
+  kprintf("TLB:\n");
+  kprintf("  cpu shootdowns sent   received  rollovers    flushes\n");
+  for (unsigned int i = 0; i < num_cpus; i++) {
+    struct tlb_cpu * tc = &tlb_cpus[i];
+    kprintf("  %3u %15lu %10lu %10lu %10lu\n", i, tc->tc_sent,
+            tc->tc_received, tc->tc_rollovers, tc->tc_flushes);
+    sent += tc->tc_sent;
+    received += tc->tc_received;
+    rollovers += tc->tc_rollovers;
+    flushes += tc->tc_flushes;
+  }
+  kprintf("  all %15lu %10lu %10lu %10lu\n", sent, received, rollovers,
+          flushes);
+
+  kprintf("Pageout daemon: %u free pages, watermarks %u/%u\n",
+          coremap_free_pages(), pageout_low, pageout_high);
+  kprintf("  %lu wakeups, %lu pages scanned, %lu laundered, %lu freed, "
+          "%lu stalls\n", pageout_wakeups, pageout_scanned, pageout_laundered,
+          pageout_freed, pageout_stalls);
+}
+
+/* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown(const struct tlbshootdown * shootdown) {
+  tlb_cpus[curcpu->c_number].tc_received++;
+  vm_tlb_shootdown_local(shootdown);
+
+  spinlock_acquire(&shootdown->ts_ack->tsa_lock);
+  shootdown->ts_ack->tsa_pending--;
+  spinlock_release(&shootdown->ts_ack->tsa_lock);
+}
+
+void set_page_owner(struct page_entry * page, paddr_t address,
+                    struct addrspace * as) {
+  page_set_owner(page, address, as, false);
+}
+
+/*
+ * Make the frame at address page's and put it on the resident queue. A page
+ * that was read ahead goes in cold, at the front of the queue and not
+ * referenced, so that it is the next to go unless somebody uses it.
+ *
+ * as is the address space whose page table the page is in, if any. It is
+ * only recorded if nobody else can have the page: shared pages may be in
+ * any number of TLBs, so evicting one still has to ask every CPU. Called
+ * with the page locked, or before anybody else can see the page.
+ */
+static void page_set_owner(struct page_entry * page, paddr_t address,
+                           struct addrspace * as, bool readahead) {
+  unsigned long page_num = (address - coremap_pagestartaddr) / PAGE_SIZE;
+
+  // Make sure that the page is actually allocated
+  KASSERT(coremap[page_num].state != FREE);
+
+  bool private = page->refcount == 1 && page->text == NULL &&
+                 page->vpage_n != VPAGE_ANYWHERE;
+
+  spinlock_acquire(&resident_lock);
+
+  coremap[page_num].owner = page;
+  coremap[page_num].as = private ? as : NULL;
+
+  if (readahead) {
+    page->readahead = true;
+    coremap[page_num].referenced = false;
+    coremap[page_num].last_use = vm_vtime - wsclock_tau - 1;
+    resident_prepend(page_num);
+  } else {
+    // The page just got used, and can be evicted from now on
+    coremap[page_num].referenced = true;
+    coremap[page_num].last_use = vm_vtime;
+    resident_append(page_num);
+  }
+
+  spinlock_release(&resident_lock);
+}
+
+/*
+ * Drop a reference to a user page. When the last one goes, free whatever
+ * backs the page (its frame if it is resident, its swap slot if it has one)
+ * along with the page entry. Waits for an eviction of the page that is
+ * under way.
+ */
+void page_release(struct page_entry * page) {
+  page_release_batch(page, NULL);
+}
+
+void page_release_batch(struct page_entry * page,
+                        struct page_free_batch * batch) {
+  bool last;
+
+  if (page->text != NULL) {
+    // The text cache has to forget the page before it goes
+    last = textcache_put(page);
+  } else {
+    page_lock(page);
+    KASSERT(page->refcount > 0);
+    page->refcount--;
+    last = page->refcount == 0;
+    page_unlock(page);
+  }
+
+  // Somebody else still has the page
+  if (!last) {
+    return;
+  }
+
+  if (batch == NULL) {
+    page_free_frames(&page, 1);
+    page_free_entry(page, NULL);
+    return;
+  }
+
+  batch->pfb_pages[batch->pfb_count++] = page;
+  if (batch->pfb_count == PAGE_FREE_BATCH) {
+    page_free_batch_drain(batch);
+  }
+}
+
+void page_free_batch_flush(struct page_free_batch * batch) {
+  page_free_batch_drain(batch);
+  swapmap_batch_flush(&batch->pfb_slots);
+}
+
+/* Free the pages in a batch, leaving their swap slots in the batch */
+static void page_free_batch_drain(struct page_free_batch * batch) {
+  if (batch->pfb_count == 0) {
+    return;
+  }
+
+  page_free_frames(batch->pfb_pages, batch->pfb_count);
+  for (unsigned int i = 0; i < batch->pfb_count; i++) {
+    page_free_entry(batch->pfb_pages[i], &batch->pfb_slots);
+  }
+
+  free_batches++;
+  free_batch_pages += batch->pfb_count;
+  batch->pfb_count = 0;
+}
+
+/*
+ * Free the frames of the resident ones among n pages nobody references
+ * any more, waiting for any eviction of them that is under way first.
+ */
+static void page_free_frames(struct page_entry ** pages, unsigned int n) {
+  unsigned int frames[PAGE_FREE_BATCH];
+  unsigned int nframes = 0;
+
+  KASSERT(n <= PAGE_FREE_BATCH);
+
+  spinlock_acquire(&resident_lock);
+
+  for (unsigned int i = 0; i < n; i++) {
+    struct page_entry * page = pages[i];
+
+    coremap_wait_unbusy(page);
+
+    if (page->swap_state == MEMORY) {
+      unsigned long page_num =
+        (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+      KASSERT(coremap[page_num].owner == page);
+      KASSERT(coremap[page_num].state == USER);
+      if (coremap[page_num].resident) {
+        resident_unlink(page_num);
+      }
+      frames[nframes++] = page_num;
+    }
+  }
+
+  spinlock_release(&resident_lock);
+
+  // A single page goes through this CPU's cache like any other, a batch
+  // straight back to the buddy allocator
+  if (nframes == 1) {
+    page_cache_put(frames[0]);
+  } else if (nframes > 1) {
+    spinlock_acquire(&coremap_lock);
+    for (unsigned int i = 0; i < nframes; i++) {
+      coremap_free_range(frames[i], 1);
+    }
+    spinlock_release(&coremap_lock);
+  }
+}
+
+/*
+ * Free the swap slot of a page whose frame is gone, if it has one, and
+ * then the page entry.
+ */
+static void page_free_entry(struct page_entry * page,
+                            struct swapmap_batch * slots) {
+  // Pages on disk and clean resident pages both hold a swap slot, except
+  // for text, which lives in its executable
+  if (page->state == CLEAN && page->text == NULL) {
+    zpool_drop(page->bitmap_disk_index);
+    if (slots != NULL) {
+      swapmap_batch_add(slots, page->bitmap_disk_index);
+    } else {
+      swapmap_free(page->bitmap_disk_index);
+    }
+  }
+
+  kfree(page);
+}
+
+/*
+ * Count a fault against as for load control, and suspend it if the load
+ * controller picked it. Faults from the kernel (copyin and friends) don't
+ * suspend, since the thread may be holding locks.
+ */
+static void loadctl_fault(struct addrspace * as) {
+  // Only the first fault of each period needs the lock
+  if (as->as_lc_period != lc_period) {
+    spinlock_acquire(&lc_lock);
+    as->as_lc_period = lc_period;
+    as->as_lc_faults = 0;
+    lc_spaces++;
+    spinlock_release(&lc_lock);
+  }
+
+  as->as_lc_faults++;
+  if (as->as_lc_faults > lc_top_faults) {
+    spinlock_acquire(&lc_lock);
+    if (as->as_lc_faults > lc_top_faults) {
+      lc_top_faults = as->as_lc_faults;
+      lc_top = as;
+    }
+    spinlock_release(&lc_lock);
+  }
+
+  if (lc_target != as || curthread->t_machdep.tm_badfaultfunc != NULL) {
+    return;
+  }
+
+  spinlock_acquire(&lc_lock);
+  bool suspend = lc_target == as;
+  lc_target = NULL;
+  spinlock_release(&lc_lock);
+
+  if (suspend) {
+    loadctl_suspend(as);
+  }
+}
+
+/* Give up the pages of as and sleep until the load controller resumes it */
+static void loadctl_suspend(struct addrspace * as) {
+  rwlock_acquire_read(as->as_lock);
+  pt_foreach(&as->as_pt, loadctl_deactivate, NULL);
+  rwlock_release_read(as->as_lock);
+
+  // Nothing is going to use them while we sleep
+  vm_tlb_invalidate_range(as, 0, USERSPACETOP);
+
+  spinlock_acquire(&lc_lock);
+
+  as->as_lc_suspended = true;
+  as->as_lc_since = lc_period;
+  as->as_lc_next = NULL;
+  if (lc_suspended_tail == NULL) {
+    lc_suspended_head = as;
+  } else {
+    lc_suspended_tail->as_lc_next = as;
+  }
+  lc_suspended_tail = as;
+  lc_suspended++;
+  lc_suspensions++;
+
+  while (as->as_lc_suspended) {
+    wchan_sleep(lc_wchan, &lc_lock);
+  }
+
+  spinlock_release(&lc_lock);
+}
+
+/* Put a page of a suspended address space first in line for eviction */
+static void loadctl_deactivate(vaddr_t vaddr, struct page_entry * page,
+                               void * unused) {
+  (void) vaddr;
+  (void) unused;
+
+  page_deactivate(page);
+}
+
+/*
+ * Put a resident page first in line for eviction, the same way readahead
+ * pages start out. Shared pages are left alone, since whoever else has
+ * them may still be using them. Returns whether the page was moved.
+ */
+static bool page_deactivate(struct page_entry * page) {
+  if (page == zero_page || page->refcount != 1 ||
+      page->swap_state != MEMORY) {
+    return false;
+  }
+
+  unsigned long page_num = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+  bool moved = false;
+
+  spinlock_acquire(&resident_lock);
+  if (coremap[page_num].owner == page && coremap[page_num].resident) {
+    resident_unlink(page_num);
+    coremap[page_num].referenced = false;
+    coremap[page_num].last_use = vm_vtime - wsclock_tau - 1;
+    page->pte = 0;
+    resident_prepend(page_num);
+    moved = true;
+  }
+  spinlock_release(&resident_lock);
+
+  return moved;
+}
+
+/* Let the address space that has been suspended longest run again */
+static void loadctl_resume(void) {
+  KASSERT(spinlock_do_i_hold(&lc_lock));
+
+  struct addrspace * as = lc_suspended_head;
+  if (as == NULL) {
+    return;
+  }
+
+  lc_suspended_head = as->as_lc_next;
+  if (lc_suspended_head == NULL) {
+    lc_suspended_tail = NULL;
+  }
+  lc_suspended--;
+  lc_resumptions++;
+
+  as->as_lc_suspended = false;
+  wchan_wakeall(lc_wchan, &lc_lock);
+}
+
+/* The medium-term scheduler. See "Load control" above. */
+static void loadctl_thread(void * unused1, unsigned long unused2) {
+  (void) unused1;
+  (void) unused2;
+
+  unsigned long last_faults = vm_vtime;
+  unsigned long last_major = major_faults;
+
+  for (;;) {
+    clocksleep(1);
+
+    unsigned long faults = vm_vtime - last_faults;
+    unsigned long major = major_faults - last_major;
+    last_faults = vm_vtime;
+    last_major = major_faults;
+
+    bool thrashing = faults >= LOADCTL_MIN_FAULTS &&
+                     major * 100 >= faults * LOADCTL_THRASH_PERCENT;
+    bool calm = faults < LOADCTL_MIN_FAULTS ||
+                major * 100 < faults * LOADCTL_RESUME_PERCENT;
+
+    spinlock_acquire(&lc_lock);
+
+    lc_target = NULL;
+    if (!loadctl_enabled) {
+      while (lc_suspended_head != NULL) {
+        loadctl_resume();
+      }
+    } else if (thrashing && lc_spaces >= 2 && lc_top != NULL) {
+      lc_target = lc_top;
+    }
+
+    if (lc_suspended_head != NULL) {
+      unsigned int out = lc_period - lc_suspended_head->as_lc_since;
+      if ((calm && out >= LOADCTL_MIN_SUSPEND) || out >= LOADCTL_MAX_SUSPEND) {
+        loadctl_resume();
+      }
+    }
+
+    lc_period++;
+    lc_spaces = 0;
+    lc_top = NULL;
+    lc_top_faults = 0;
+
+    spinlock_release(&lc_lock);
+  }
+}
+
+int vm_setloadctl(bool enabled) {
+  if (enabled && !can_swap) {
+    return ENOSYS;
+  }
+
+  loadctl_enabled = enabled;
+  return 0;
+}
+
+int vm_madvise(struct addrspace * as, vaddr_t vaddr, size_t len,
+               int advice) {
+  vaddr_t end = vaddr + len;
+
+  // Only prefetching leaves the segments and page table alone
+  if (advice == MADV_WILLNEED) {
+    rwlock_acquire_read(as->as_lock);
+  } else {
+    rwlock_acquire_write(as->as_lock);
+  }
+
+  if (!vm_range_mapped(as, vaddr, end)) {
+    if (advice == MADV_WILLNEED) {
+      rwlock_release_read(as->as_lock);
+    } else {
+      rwlock_release_write(as->as_lock);
+    }
+    return ENOMEM;
+  }
+
+  switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      // Access patterns stick to whole segments
+      for (unsigned int i = 0; i < array_num(as->segments_list); i++) {
+        struct segment_entry * seg = array_get(as->segments_list, i);
+        if (seg->region_start < end &&
+            seg->region_start + seg->region_size > vaddr) {
+          seg->advice = advice;
+        }
+      }
+      break;
+
+    case MADV_WILLNEED:
+      vm_willneed(as, vaddr, end);
+      break;
+
+    case MADV_DONTNEED:
+      // Like munmap, except the segments stay, so the pages come back as
+      // new the next time they are touched
+      pt_release_range(&as->as_pt, vaddr, end, as);
+      advice_dontneed++;
+      break;
+
+    default:
+      panic("vm_madvise: bad advice %d\n", advice);
+  }
+
+  if (advice == MADV_WILLNEED) {
+    rwlock_release_read(as->as_lock);
+  } else {
+    rwlock_release_write(as->as_lock);
+  }
+  return 0;
+}
+
+int vm_mincore(struct addrspace * as, vaddr_t vaddr, unsigned int npages,
+               char * vec) {
+  rwlock_acquire_read(as->as_lock);
+
+  if (!vm_range_mapped(as, vaddr, vaddr + npages * PAGE_SIZE)) {
+    rwlock_release_read(as->as_lock);
+    return ENOMEM;
+  }
+
+  // Only a snapshot; the pages can come and go as soon as we look away
+  for (unsigned int i = 0; i < npages; i++) {
+    struct page_entry * page = pt_lookup(&as->as_pt, vaddr + i * PAGE_SIZE);
+    vec[i] = page != NULL && page->swap_state == MEMORY;
+  }
+
+  rwlock_release_read(as->as_lock);
+  return 0;
+}
+
+/*
+ * Whether every page in [start, end) is at least partly in some segment.
+ * Called with as->as_lock held.
+ */
+static bool vm_range_mapped(struct addrspace * as, vaddr_t start,
+                            vaddr_t end) {
+  for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+    if (find_segment_overlap(as, vaddr, vaddr + PAGE_SIZE) == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Bring the pages of as in [start, end) that are on disk back in, as far
+ * as there are free frames for them; it isn't worth evicting anything
+ * else for. Runs of pages that went out together come back with one read
+ * (see swap_in). Called with as->as_lock held for reading.
+ */
+static void vm_willneed(struct addrspace * as, vaddr_t start, vaddr_t end) {
+  for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+    // Only a peek; swap_in looks again with the page locked
+    struct page_entry * page = pt_lookup(&as->as_pt, vaddr);
+    if (page == NULL || page->swap_state != DISK) {
+      continue;
+    }
+
+    paddr_t paddr = getppages(1, VM_ALLOC_NOZERO | VM_ALLOC_NOEVICT);
+    if (paddr == 0) {
+      break;
+    }
+
+    struct segment_entry * seg = find_segment_overlap(as, vaddr,
+                                                      vaddr + PAGE_SIZE);
+    if (swap_in(as, seg, page, paddr)) {
+      advice_willneed++;
+    } else {
+      freeppage(paddr);
+    }
+  }
+}
+
+void vm_reap(struct addrspace * as) {
+  unsigned int npages = pt_count(&as->as_pt);
+
+  // Load control must not mistake the next address space to be allocated
+  // here for this one
+  spinlock_acquire(&lc_lock);
+  if (lc_top == as) {
+    lc_top = NULL;
+    lc_top_faults = 0;
+  }
+  if (lc_target == as) {
+    lc_target = NULL;
+  }
+  spinlock_release(&lc_lock);
+
+  if (reaper_threshold == 0 || npages < reaper_threshold) {
+    as_reap(as);
+    return;
+  }
+
+  spinlock_acquire(&reaper_lock);
+  as->as_reap_next = NULL;
+  if (reaper_tail == NULL) {
+    reaper_head = as;
+  } else {
+    reaper_tail->as_reap_next = as;
+  }
+  reaper_tail = as;
+  reaper_spaces++;
+  reaper_pages += npages;
+  wchan_wakeone(reaper_wchan, &reaper_lock);
+  spinlock_release(&reaper_lock);
+}
+
+/* The reaper thread. Frees the address spaces queued by vm_reap. */
+static void reaper_thread(void * unused1, unsigned long unused2) {
+  (void) unused1;
+  (void) unused2;
+
+  for (;;) {
+    spinlock_acquire(&reaper_lock);
+    while (reaper_head == NULL) {
+      wchan_sleep(reaper_wchan, &reaper_lock);
+    }
+    struct addrspace * as = reaper_head;
+    reaper_head = as->as_reap_next;
+    if (reaper_head == NULL) {
+      reaper_tail = NULL;
+    }
+    spinlock_release(&reaper_lock);
+
+    as_reap(as);
+  }
+}
+
+static struct page_lock_bucket * page_lock_bucket(struct page_entry * page) {
+  // Page entries are 32 byte kmalloc blocks
+  return &page_lock_buckets[((uintptr_t)page / 32) % PAGE_LOCK_BUCKETS];
+}
+
+void page_lock(struct page_entry * page) {
+  struct page_lock_bucket * plb = page_lock_bucket(page);
+
+  KASSERT(!curthread->t_in_interrupt);
+
+  spinlock_acquire(&plb->plb_lock);
+  while (page->locked) {
+    wchan_sleep(plb->plb_wchan, &plb->plb_lock);
+  }
+  page->locked = true;
+  spinlock_release(&plb->plb_lock);
+}
+
+void page_unlock(struct page_entry * page) {
+  struct page_lock_bucket * plb = page_lock_bucket(page);
+
+  spinlock_acquire(&plb->plb_lock);
+  KASSERT(page->locked);
+  page->locked = false;
+  wchan_wakeall(plb->plb_wchan, &plb->plb_lock);
+  spinlock_release(&plb->plb_lock);
+}
+
+void page_share(struct page_entry * page) {
+  page_lock(page);
+  page->refcount++;
+
+  // Writes have to fault from now on, and the page isn't any one address
+  // space's any more
+  spinlock_acquire(&resident_lock);
+  page->pte &= ~TLBLO_DIRTY;
+  if (page->swap_state == MEMORY) {
+    coremap[(page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE].as = NULL;
+  }
+  spinlock_release(&resident_lock);
+
+  page_unlock(page);
+}
+
+bool vm_page_pin(struct page_entry * page) {
+  spinlock_acquire(&resident_lock);
+
+  // Other sharers of the page can evict it or bring it back in meanwhile,
+  // so where it is only counts once resident_lock is held
+  coremap_wait_unbusy(page);
+
+  if (page->swap_state != MEMORY) {
+    spinlock_release(&resident_lock);
+    return false;
+  }
+
+  unsigned long page_num = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+  KASSERT(coremap[page_num].owner == page);
+  KASSERT(coremap[page_num].resident);
+
+  resident_unlink(page_num);
+  coremap[page_num].busy = true;
+
+  spinlock_release(&resident_lock);
+  return true;
+}
+
+void vm_page_unpin(struct page_entry * page) {
+  unsigned long page_num = (page->ppage_n - coremap_pagestartaddr) / PAGE_SIZE;
+
+  spinlock_acquire(&resident_lock);
+
+  KASSERT(coremap[page_num].busy);
+  coremap[page_num].busy = false;
+  resident_append(page_num);
+  wchan_wakeall(evict_wchan, &resident_lock);
+
+  spinlock_release(&resident_lock);
+}
+
+int vm_setpolicy(const char * name, unsigned long tau) {
+  for (unsigned int i = 0; i < ARRAYCOUNT(vm_policies); i++) {
+    if (!strcmp(name, vm_policies[i].vp_name)) {
+      vm_policy = &vm_policies[i];
+      if (tau != 0) {
+        wsclock_tau = tau;
+      }
+      return 0;
+    }
+  }
+
+  return EINVAL;
 }
@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compressed swap cache. See zpool.h.
+ *
+ * The pool is made of kernel pages cut into ZPOOL_CHUNK byte chunks. Each
+ * entry takes a run of chunks in one page: a header saying which slot it
+ * holds, then the compressed contents. The pages are filled and written
+ * back in a circle, so the ones written back are roughly the oldest.
+ *
+ * Pages are compressed with a small LZ77 codec using the LZ4 block format:
+ * a token byte with the number of literals and the match length in its
+ * nibbles (15 meaning more length bytes follow), the literals, and a
+ * 16-bit offset back to the match. The last sequence has no match.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <zpool.h>
+
+#define ZPOOL_CHUNK 128
+#define ZPOOL_CHUNKS (PAGE_SIZE / ZPOOL_CHUNK)    // a bit each in a word
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 10
+
+struct zpool_header {
+  uint32_t zh_slot;
+  uint32_t zh_len;          // bytes of compressed data after the header
+};
+
+struct zpool_frame {
+  vaddr_t zf_base;
+  uint32_t zf_used;         // a bit per chunk, set while in use
+  uint32_t zf_starts;       // a bit per chunk that starts an entry
+};
+
+// Protects everything below. Taken after a page's lock.
+static struct lock * zpool_lock;
+
+// Per slot, 0 if its contents aren't in the pool, or 1 + the chunk
+// (counting across all pool pages) its entry starts at
+static uint32_t * zpool_map;
+static unsigned int zpool_slots;
+
+static struct zpool_frame * zpool_frames;
+static unsigned int zpool_nframes;
+static unsigned int zpool_percent;
+static unsigned int zpool_hand;           // next pool page to write back
+
+// Compressor output, and a page to decompress entries being written back
+static uint8_t zpool_buf[ZPOOL_MAX_BYTES];
+static vaddr_t zpool_scratch;
+
+// Where each hashed 4-byte sequence was last seen in the page
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+// Statistics, printed by zpool_printstats
+static unsigned int zpool_entries;
+static unsigned long zpool_bytes;
+static unsigned long zpool_stores;
+static unsigned long zpool_rejects;
+static unsigned long zpool_hits;
+static unsigned long zpool_writebacks;
+static unsigned long zpool_drops;
+
+static uint32_t lz_read32(const uint8_t * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Append the part of a length that didn't fit in its token nibble */
+static bool lz_put_length(uint8_t * dst, unsigned int * op, unsigned int max,
+                          unsigned int len) {
+  for (;;) {
+    if (*op >= max) {
+      return false;
+    }
+    if (len < 255) {
+      dst[(*op)++] = len;
+      return true;
+    }
+    dst[(*op)++] = 255;
+    len -= 255;
+  }
+}
+
+/*
+ * Append litlen literals from lit, then a match of mlen bytes offset bytes
+ * back, or no match if mlen is 0. Returns false if it doesn't fit in max.
+ */
+static bool lz_put_sequence(uint8_t * dst, unsigned int * op,
+                            unsigned int max, const uint8_t * lit,
+                            unsigned int litlen, unsigned int offset,
+                            unsigned int mlen) {
+  if (*op >= max) {
+    return false;
+  }
+
+  unsigned int token = (*op)++;
+  dst[token] = (litlen < 15 ? litlen : 15) << 4;
+  if (litlen >= 15 && !lz_put_length(dst, op, max, litlen - 15)) {
+    return false;
+  }
+
+  if (*op + litlen > max) {
+    return false;
+  }
+  memcpy(dst + *op, lit, litlen);
+  *op += litlen;
+
+  if (mlen == 0) {
+    return true;
+  }
+
+  if (*op + 2 > max) {
+    return false;
+  }
+  dst[(*op)++] = offset & 0xff;
+  dst[(*op)++] = offset >> 8;
+
+  mlen -= LZ_MINMATCH;
+  dst[token] |= mlen < 15 ? mlen : 15;
+  if (mlen >= 15 && !lz_put_length(dst, op, max, mlen - 15)) {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Compress a page into dst. Returns the compressed size, or 0 if it would
+ * be more than max bytes. Called with zpool_lock held, for lz_table.
+ */
+static unsigned int lz_compress(const uint8_t * src, uint8_t * dst,
+                                unsigned int max) {
+  unsigned int ip = 0;
+  unsigned int anchor = 0;
+  unsigned int op = 0;
+
+  bzero(lz_table, sizeof(lz_table));
+
+  while (ip + LZ_MINMATCH <= PAGE_SIZE) {
+    uint32_t seq = lz_read32(src + ip);
+    unsigned int hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+    unsigned int ref = lz_table[hash];
+    lz_table[hash] = ip;
+
+    if (ref >= ip || lz_read32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    unsigned int mlen = LZ_MINMATCH;
+    while (ip + mlen < PAGE_SIZE && src[ref + mlen] == src[ip + mlen]) {
+      mlen++;
+    }
+
+    if (!lz_put_sequence(dst, &op, max, src + anchor, ip - anchor, ip - ref,
+                         mlen)) {
+      return 0;
+    }
+    ip += mlen;
+    anchor = ip;
+  }
+
+  if (!lz_put_sequence(dst, &op, max, src + anchor, PAGE_SIZE - anchor,
+                       0, 0)) {
+    return 0;
+  }
+  return op;
+}
+
+/* Read the rest of a length whose token nibble was 15 */
+static bool lz_get_length(const uint8_t * src, unsigned int len,
+                          unsigned int * ip, unsigned int * length) {
+  uint8_t byte;
+
+  do {
+    if (*ip >= len) {
+      return false;
+    }
+    byte = src[(*ip)++];
+    *length += byte;
+  } while (byte == 255);
+
+  return true;
+}
+
+/* Decompress len bytes from src into a page. Returns false if corrupt. */
+static bool lz_decompress(const uint8_t * src, unsigned int len,
+                          uint8_t * dst) {
+  unsigned int ip = 0;
+  unsigned int op = 0;
+
+  while (ip < len) {
+    unsigned int token = src[ip++];
+
+    unsigned int litlen = token >> 4;
+    if (litlen == 15 && !lz_get_length(src, len, &ip, &litlen)) {
+      return false;
+    }
+    if (ip + litlen > len || op + litlen > PAGE_SIZE) {
+      return false;
+    }
+    memcpy(dst + op, src + ip, litlen);
+    ip += litlen;
+    op += litlen;
+
+    // The last sequence is just literals
+    if (ip == len) {
+      break;
+    }
+
+    if (ip + 2 > len) {
+      return false;
+    }
+    unsigned int offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+
+    unsigned int mlen = token & 0xf;
+    if (mlen == 15 && !lz_get_length(src, len, &ip, &mlen)) {
+      return false;
+    }
+    mlen += LZ_MINMATCH;
+    if (offset == 0 || offset > op || op + mlen > PAGE_SIZE) {
+      return false;
+    }
+
+    // The match can overlap what it is copying, so go a byte at a time
+    for (unsigned int i = 0; i < mlen; i++) {
+      dst[op + i] = dst[op + i - offset];
+    }
+    op += mlen;
+  }
+
+  return op == PAGE_SIZE;
+}
+
+static unsigned int entry_chunks(unsigned int len) {
+  return (sizeof(struct zpool_header) + len + ZPOOL_CHUNK - 1) / ZPOOL_CHUNK;
+}
+
+static uint32_t chunk_mask(unsigned int chunk, unsigned int n) {
+  KASSERT(n < 32);
+  return (((uint32_t)1 << n) - 1) << chunk;
+}
+
+/* First run of n free chunks in a pool page, or -1 */
+static int chunk_find(uint32_t used, unsigned int n) {
+  for (unsigned int chunk = 0; chunk + n <= ZPOOL_CHUNKS; chunk++) {
+    if ((used & chunk_mask(chunk, n)) == 0) {
+      return chunk;
+    }
+  }
+  return -1;
+}
+
+static struct zpool_header * entry_header(uint32_t where) {
+  struct zpool_frame * zf = &zpool_frames[where / ZPOOL_CHUNKS];
+  return (struct zpool_header *)(zf->zf_base +
+                                 (where % ZPOOL_CHUNKS) * ZPOOL_CHUNK);
+}
+
+/* Forget slot's entry. Called with zpool_lock held. */
+static void zpool_remove(unsigned int slot) {
+  uint32_t where = zpool_map[slot] - 1;
+  struct zpool_frame * zf = &zpool_frames[where / ZPOOL_CHUNKS];
+  struct zpool_header * zh = entry_header(where);
+  unsigned int chunk = where % ZPOOL_CHUNKS;
+
+  KASSERT(zpool_map[slot] != 0);
+  KASSERT(zh->zh_slot == slot);
+
+  zf->zf_used &= ~chunk_mask(chunk, entry_chunks(zh->zh_len));
+  zf->zf_starts &= ~((uint32_t)1 << chunk);
+  zpool_map[slot] = 0;
+  zpool_entries--;
+  zpool_bytes -= zh->zh_len;
+}
+
+/*
+ * Write every entry in a pool page out to its slot on disk and empty the
+ * page. Called with zpool_lock held.
+ */
+static void zpool_writeback(unsigned int frame) {
+  struct zpool_frame * zf = &zpool_frames[frame];
+
+  while (zf->zf_starts != 0) {
+    unsigned int chunk = 0;
+    while (!(zf->zf_starts & ((uint32_t)1 << chunk))) {
+      chunk++;
+    }
+
+    uint32_t where = frame * ZPOOL_CHUNKS + chunk;
+    struct zpool_header * zh = entry_header(where);
+    unsigned int slot = zh->zh_slot;
+
+    if (!lz_decompress((uint8_t *)(zh + 1), zh->zh_len,
+                       (uint8_t *)zpool_scratch)) {
+      panic("zpool: entry for slot %u is corrupt\n", slot);
+    }
+    block_write(slot, KVADDR_TO_PADDR(zpool_scratch));
+
+    // Only now that the contents are on disk can a swap-in go there
+    zpool_remove(slot);
+    zpool_writebacks++;
+  }
+}
+
+void zpool_bootstrap(unsigned int nslots) {
+  zpool_lock = lock_create("zpool");
+  zpool_map = kmalloc(nslots * sizeof(uint32_t));
+  if (zpool_lock == NULL || zpool_map == NULL) {
+    panic("zpool_bootstrap: out of memory\n");
+  }
+
+  for (unsigned int i = 0; i < nslots; i++) {
+    zpool_map[i] = 0;
+  }
+  zpool_slots = nslots;
+}
+
+int zpool_setpercent(unsigned int percent) {
+  if (percent > ZPOOL_MAX_PERCENT) {
+    return EINVAL;
+  }
+  if (zpool_map == NULL) {
+    // No swap to cache
+    return ENODEV;
+  }
+
+  if (zpool_scratch == 0) {
+    zpool_scratch = alloc_kpages(1);
+    if (zpool_scratch == 0) {
+      return ENOMEM;
+    }
+  }
+
+  // Get the new pages first, without the lock, since getting them may
+  // well mean evicting something into the old ones
+  unsigned int nframes = COREMAP_PAGES * percent / 100;
+  struct zpool_frame * frames = NULL;
+  if (nframes > 0) {
+    frames = kmalloc(nframes * sizeof(struct zpool_frame));
+    if (frames == NULL) {
+      return ENOMEM;
+    }
+    for (unsigned int i = 0; i < nframes; i++) {
+      frames[i].zf_base = alloc_kpages(1);
+      if (frames[i].zf_base == 0) {
+        while (i-- > 0) {
+          free_kpages(frames[i].zf_base);
+        }
+        kfree(frames);
+        return ENOMEM;
+      }
+      frames[i].zf_used = 0;
+      frames[i].zf_starts = 0;
+    }
+  }
+
+  lock_acquire(zpool_lock);
+
+  for (unsigned int i = 0; i < zpool_nframes; i++) {
+    zpool_writeback(i);
+  }
+  KASSERT(zpool_entries == 0);
+
+  struct zpool_frame * old = zpool_frames;
+  unsigned int oldn = zpool_nframes;
+  zpool_frames = frames;
+  zpool_nframes = nframes;
+  zpool_percent = percent;
+  zpool_hand = 0;
+
+  lock_release(zpool_lock);
+
+  for (unsigned int i = 0; i < oldn; i++) {
+    free_kpages(old[i].zf_base);
+  }
+  if (old != NULL) {
+    kfree(old);
+  }
+
+  return 0;
+}
+
+bool zpool_store(unsigned int slot, paddr_t paddr) {
+  if (zpool_nframes == 0) {
+    return false;
+  }
+
+  lock_acquire(zpool_lock);
+
+  if (zpool_nframes == 0) {
+    lock_release(zpool_lock);
+    return false;
+  }
+
+  KASSERT(slot < zpool_slots);
+  KASSERT(zpool_map[slot] == 0);
+
+  unsigned int len = lz_compress((uint8_t *)PADDR_TO_KVADDR(paddr), zpool_buf,
+                                 ZPOOL_MAX_BYTES);
+  if (len == 0) {
+    zpool_rejects++;
+    lock_release(zpool_lock);
+    return false;
+  }
+
+  // Look for room, newest pool page first. If there is none, the oldest
+  // one gets written back and becomes the newest.
+  unsigned int n = entry_chunks(len);
+  unsigned int frame = 0;
+  int chunk = -1;
+  for (unsigned int i = 1; i <= zpool_nframes && chunk == -1; i++) {
+    frame = (zpool_hand + zpool_nframes - i) % zpool_nframes;
+    chunk = chunk_find(zpool_frames[frame].zf_used, n);
+  }
+  if (chunk == -1) {
+    frame = zpool_hand;
+    zpool_writeback(frame);
+    zpool_hand = (zpool_hand + 1) % zpool_nframes;
+    chunk = 0;
+  }
+
+  struct zpool_frame * zf = &zpool_frames[frame];
+  zf->zf_used |= chunk_mask(chunk, n);
+  zf->zf_starts |= (uint32_t)1 << chunk;
+
+  uint32_t where = frame * ZPOOL_CHUNKS + chunk;
+  struct zpool_header * zh = entry_header(where);
+  zh->zh_slot = slot;
+  zh->zh_len = len;
+  memcpy(zh + 1, zpool_buf, len);
+
+  zpool_map[slot] = where + 1;
+  zpool_entries++;
+  zpool_bytes += len;
+  zpool_stores++;
+
+  lock_release(zpool_lock);
+  return true;
+}
+
+/*
+ * Decompress slot's contents into paddr if the pool has them, and forget
+ * them if asked to.
+ */
+static bool zpool_get(unsigned int slot, paddr_t paddr, bool forget) {
+  if (!zpool_contains(slot)) {
+    return false;
+  }
+
+  lock_acquire(zpool_lock);
+
+  // It may have been written back in the meantime
+  if (zpool_map[slot] == 0) {
+    lock_release(zpool_lock);
+    return false;
+  }
+
+  struct zpool_header * zh = entry_header(zpool_map[slot] - 1);
+  if (!lz_decompress((uint8_t *)(zh + 1), zh->zh_len,
+                     (uint8_t *)PADDR_TO_KVADDR(paddr))) {
+    panic("zpool: entry for slot %u is corrupt\n", slot);
+  }
+
+  if (forget) {
+    zpool_remove(slot);
+  }
+  zpool_hits++;
+
+  lock_release(zpool_lock);
+  return true;
+}
+
+bool zpool_load(unsigned int slot, paddr_t paddr) {
+  return zpool_get(slot, paddr, true);
+}
+
+bool zpool_read(unsigned int slot, paddr_t paddr) {
+  return zpool_get(slot, paddr, false);
+}
+
+bool zpool_contains(unsigned int slot) {
+  return zpool_map != NULL && zpool_map[slot] != 0;
+}
+
+void zpool_drop(unsigned int slot) {
+  if (!zpool_contains(slot)) {
+    return;
+  }
+
+  lock_acquire(zpool_lock);
+  if (zpool_map[slot] != 0) {
+    zpool_remove(slot);
+    zpool_drops++;
+  }
+  lock_release(zpool_lock);
+}
+
+void zpool_printstats(void) {
+  unsigned long ratio = zpool_entries == 0 ? 0 :
+                        zpool_bytes * 100 / (zpool_entries * PAGE_SIZE);
+
+  kprintf("Compressed pool: %u pages (%u%% of memory), %u entries at %lu%% "
+          "of their size\n", zpool_nframes, zpool_percent, zpool_entries,
+          ratio);
+  kprintf("  %lu stored, %lu incompressible, %lu hits, %lu written back, "
+          "%lu dropped\n", zpool_stores, zpool_rejects, zpool_hits,
+          zpool_writebacks, zpool_drops);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * advsort - merge sort an array bigger than memory, with and without
+ * telling the VM how it is being used.
+ *
+ * Usage: advsort [-a] [size-kb]
+ *
+ * The array and a scratch array of the same size are anonymous
+ * mappings. Each pass of a bottom-up merge sort reads one of them from
+ * start to end and writes the other, then they trade places. With -a:
+ *
+ *    - both are MADV_SEQUENTIAL, so swap is read far ahead and pages
+ *      the scan has left behind go first;
+ *    - after each pass, the array that was read is MADV_DONTNEED,
+ *      since the next pass overwrites all of it, so it never gets
+ *      written to swap;
+ *    - the result is MADV_WILLNEED before it is checked.
+ *
+ * Compare the time, and the swap I/O in vmstat, of a run with and a
+ * run without -a. At the end, mincore tells how much of the result is
+ * still in memory.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+#define DEFAULT_SIZE_KB 2048
+
+struct stamp {
+	time_t s;
+	unsigned long ns;
+};
+
+static int advise;
+
+static
+unsigned long
+elapsed_usec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000UL + t1->ns / 1000 - t0->ns / 1000;
+}
+
+static
+void
+advice(void *p, size_t size, int how, const char *what)
+{
+	if (advise && madvise(p, size, how) < 0) {
+		err(1, "madvise %s", what);
+	}
+}
+
+static
+int *
+getarray(size_t size)
+{
+	int *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	advice(p, size, MADV_SEQUENTIAL, "sequential");
+	return p;
+}
+
+/* Merge the sorted runs of WIDTH elements in SRC into runs twice as long */
+static
+void
+mergepass(const int *src, int *dst, unsigned n, unsigned width)
+{
+	unsigned start, mid, end, i, j, k;
+
+	for (start = 0; start < n; start += 2 * width) {
+		mid = start + width < n ? start + width : n;
+		end = start + 2 * width < n ? start + 2 * width : n;
+		i = start;
+		j = mid;
+		k = start;
+		while (i < mid && j < end) {
+			dst[k++] = src[i] <= src[j] ? src[i++] : src[j++];
+		}
+		while (i < mid) {
+			dst[k++] = src[i++];
+		}
+		while (j < end) {
+			dst[k++] = src[j++];
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long sizekb = DEFAULT_SIZE_KB;
+	struct stamp t0, t1;
+	size_t size;
+	unsigned n, i, width, passes, resident;
+	int *a, *b, *t;
+	char *vec;
+
+	if (argc > 1 && !strcmp(argv[1], "-a")) {
+		advise = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1) {
+		sizekb = atoi(argv[1]);
+	}
+	size = (sizekb * 1024 + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	if (size == 0) {
+		errx(1, "Usage: advsort [-a] [size-kb]");
+	}
+	n = size / sizeof(int);
+
+	a = getarray(size);
+	b = getarray(size);
+	vec = malloc(size / PAGE_SIZE);
+	if (vec == NULL) {
+		err(1, "malloc");
+	}
+
+	srandom(533);
+	for (i = 0; i < n; i++) {
+		a[i] = random();
+	}
+
+	__time(&t0.s, &t0.ns);
+	passes = 0;
+	for (width = 1; width < n; width *= 2) {
+		mergepass(a, b, n, width);
+		/* Everything in a gets overwritten by the next pass */
+		advice(a, size, MADV_DONTNEED, "dontneed");
+		t = a;
+		a = b;
+		b = t;
+		passes++;
+	}
+	__time(&t1.s, &t1.ns);
+
+	advice(a, size, MADV_WILLNEED, "willneed");
+	for (i = 0; i < n - 1; i++) {
+		if (a[i] > a[i + 1]) {
+			errx(1, "Failed: a[%u] is %d, a[%u] is %d",
+			     i, a[i], i + 1, a[i + 1]);
+		}
+	}
+
+	if (mincore(a, size, vec) < 0) {
+		err(1, "mincore");
+	}
+	resident = 0;
+	for (i = 0; i < size / PAGE_SIZE; i++) {
+		resident += vec[i];
+	}
+
+	printf("advsort: %u ints, %u passes %s advice, %lu usec; "
+	       "%u of %u pages of the result resident\n", n, passes,
+	       advise ? "with" : "without", elapsed_usec(&t0, &t1),
+	       resident, size / PAGE_SIZE);
+	return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * exitlat - measure how long a process with a large heap takes to exit.
+ *
+ * Usage: exitlat [heap-kb] [rounds]
+ *
+ * Each round, a child grows its heap with sbrk, writes every page of
+ * it, and exits. Just before exiting it leaves the time in a file. The
+ * parent waits for that, then calls waitpid, and reports:
+ *
+ *    exit latency     from the child calling _exit to waitpid returning
+ *    waitpid latency  from the parent calling waitpid to it returning
+ *
+ * Both are dominated by tearing down the child's address space, unless
+ * the kernel does that in the background.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+#define DEFAULT_HEAP_KB (16 * 1024)
+#define DEFAULT_ROUNDS 4
+
+#define STAMPFILE "exitlat.tmp"
+
+struct stamp {
+	time_t s;
+	unsigned long ns;
+};
+
+static
+unsigned long
+elapsed_usec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000UL + t1->ns / 1000 - t0->ns / 1000;
+}
+
+static
+void
+child(unsigned npages)
+{
+	volatile char *heap;
+	struct stamp now;
+	unsigned i;
+	int fd;
+
+	heap = sbrk(npages * PAGE_SIZE);
+	if (heap == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i = 0; i < npages; i++) {
+		heap[i * PAGE_SIZE] = (char)i;
+	}
+
+	fd = open(STAMPFILE, O_WRONLY);
+	if (fd < 0) {
+		err(1, "%s", STAMPFILE);
+	}
+	__time(&now.s, &now.ns);
+	if (write(fd, &now, sizeof(now)) != sizeof(now)) {
+		err(1, "%s: write", STAMPFILE);
+	}
+	close(fd);
+
+	_exit(0);
+}
+
+/* Wait for the child to leave its exit time in the file */
+static
+void
+waitstamp(struct stamp *t)
+{
+	int fd, len;
+
+	do {
+		fd = open(STAMPFILE, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s", STAMPFILE);
+		}
+		len = read(fd, t, sizeof(*t));
+		if (len < 0) {
+			err(1, "%s: read", STAMPFILE);
+		}
+		close(fd);
+	} while (len != sizeof(*t));
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long heapkb = DEFAULT_HEAP_KB;
+	unsigned rounds = DEFAULT_ROUNDS;
+	unsigned long exitusec, waitusec, exittotal = 0, waittotal = 0;
+	struct stamp exited, called, returned;
+	unsigned npages, i;
+	int fd, status;
+	pid_t pid;
+
+	if (argc > 1) {
+		heapkb = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rounds = atoi(argv[2]);
+	}
+	if (heapkb == 0 || rounds == 0) {
+		errx(1, "Usage: exitlat [heap-kb] [rounds]");
+	}
+	npages = (heapkb * 1024 + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	for (i = 0; i < rounds; i++) {
+		fd = open(STAMPFILE, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+		if (fd < 0) {
+			err(1, "%s", STAMPFILE);
+		}
+		close(fd);
+
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			child(npages);
+		}
+
+		waitstamp(&exited);
+
+		__time(&called.s, &called.ns);
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		__time(&returned.s, &returned.ns);
+
+		if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", pid);
+		}
+
+		exitusec = elapsed_usec(&exited, &returned);
+		waitusec = elapsed_usec(&called, &returned);
+		printf("exitlat: round %u: exit latency %lu usec, "
+		       "waitpid latency %lu usec\n", i, exitusec, waitusec);
+		exittotal += exitusec;
+		waittotal += waitusec;
+	}
+
+	printf("exitlat: %u pages, %u rounds, %lu usec exit latency, "
+	       "%lu usec waitpid latency on average\n", npages, rounds,
+	       exittotal / rounds, waittotal / rounds);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forklat - measure fork latency for a process with a large heap.
+ *
+ * Usage: forklat [heap-kb] [forks]
+ *
+ * The process grows its heap with sbrk, touches every page of it, and
+ * then times a series of forks whose children exit right away (as they
+ * would before execv). With copy-on-write fork this should be roughly
+ * independent of the heap size; with eager copying it grows linearly.
+ *
+ * At the end, one more child writes every heap page, to time the
+ * copy-on-write faults themselves and to check the parent's data is
+ * left alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+#define DEFAULT_HEAP_KB 1024
+#define DEFAULT_FORKS 32
+
+static
+unsigned long
+elapsed_usec(time_t s0, unsigned long ns0, time_t s1, unsigned long ns1)
+{
+	return (s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+dowait(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child %d failed", pid);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long heapkb = DEFAULT_HEAP_KB;
+	unsigned forks = DEFAULT_FORKS;
+	unsigned npages, i;
+	volatile char *heap;
+	time_t s0, s1;
+	unsigned long ns0, ns1, usec;
+	pid_t pid;
+
+	if (argc > 1) {
+		heapkb = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		forks = atoi(argv[2]);
+	}
+	if (heapkb == 0 || forks == 0) {
+		errx(1, "Usage: forklat [heap-kb] [forks]");
+	}
+
+	npages = (heapkb * 1024 + PAGE_SIZE - 1) / PAGE_SIZE;
+	heap = sbrk(npages * PAGE_SIZE);
+	if (heap == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	/* Fault in the whole heap so the parent owns every page. */
+	for (i = 0; i < npages; i++) {
+		heap[i * PAGE_SIZE] = (char)i;
+	}
+
+	__time(&s0, &ns0);
+	for (i = 0; i < forks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		dowait(pid);
+	}
+	__time(&s1, &ns1);
+
+	usec = elapsed_usec(s0, ns0, s1, ns1);
+	printf("forklat: %u pages, %u forks, %lu usec per fork+exit\n",
+	       npages, forks, usec / forks);
+
+	/* Now have a child write every page. */
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i = 0; i < npages; i++) {
+			heap[i * PAGE_SIZE] = (char)~i;
+		}
+		_exit(0);
+	}
+	dowait(pid);
+	__time(&s1, &ns1);
+
+	usec = elapsed_usec(s0, ns0, s1, ns1);
+	printf("forklat: child wrote %u pages in %lu usec\n", npages, usec);
+
+	for (i = 0; i < npages; i++) {
+		if (heap[i * PAGE_SIZE] != (char)i) {
+			errx(1, "page %u changed under the parent", i);
+		}
+	}
+
+	printf("forklat: passed\n");
+	return 0;
+}
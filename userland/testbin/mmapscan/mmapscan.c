@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmapscan - scan a large file with read() and with mmap(), and check
+ * that mappings behave.
+ *
+ * Usage: mmapscan [filename] [size-kb]
+ *
+ * Writes a file of the given size full of numbered words, then sums
+ * it up twice: reading it a chunk at a time into a buffer, and through
+ * a private read-only mapping. Both bring the file in from disk the
+ * same way, so the difference between them is the copy out of the
+ * kernel that read() makes and the mapping doesn't.
+ *
+ * After that it checks that:
+ *    - writes to a MAP_SHARED mapping end up in the file, and are seen
+ *      by a child sharing the mapping;
+ *    - writes to a MAP_PRIVATE mapping don't;
+ *    - anonymous mappings are zero-filled and can be partly unmapped.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+#define CHUNK 8192
+
+#define DEFAULT_FILE "mmapscan.tmp"
+#define DEFAULT_SIZE_KB 1024
+
+#define MAGIC 0x5a5a1234
+
+struct stamp {
+	time_t s;
+	unsigned long ns;
+};
+
+static unsigned buffer[CHUNK / sizeof(unsigned)];
+
+static
+unsigned long
+elapsed_usec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000UL + t1->ns / 1000 - t0->ns / 1000;
+}
+
+static
+unsigned
+word(unsigned i)
+{
+	return i ^ MAGIC;
+}
+
+static
+void
+makefile(const char *name, size_t size)
+{
+	size_t i, j;
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	for (i = 0; i < size; i += CHUNK) {
+		for (j = 0; j < CHUNK / sizeof(unsigned); j++) {
+			buffer[j] = word(i / sizeof(unsigned) + j);
+		}
+		if (write(fd, buffer, CHUNK) != CHUNK) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+}
+
+static
+unsigned
+scan_read(const char *name, size_t size)
+{
+	unsigned sum = 0;
+	size_t i, j;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	for (i = 0; i < size; i += CHUNK) {
+		if (read(fd, buffer, CHUNK) != CHUNK) {
+			err(1, "%s: read", name);
+		}
+		for (j = 0; j < CHUNK / sizeof(unsigned); j++) {
+			sum += buffer[j];
+		}
+	}
+	close(fd);
+	return sum;
+}
+
+static
+unsigned
+scan_mmap(const char *name, size_t size)
+{
+	const unsigned *p;
+	unsigned sum = 0;
+	size_t i;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", name);
+	}
+	/* The mapping keeps the file open */
+	close(fd);
+
+	for (i = 0; i < size / sizeof(unsigned); i++) {
+		sum += p[i];
+	}
+
+	if (munmap((void *)p, size) < 0) {
+		err(1, "munmap");
+	}
+	return sum;
+}
+
+static
+unsigned
+readword(int fd, size_t offset)
+{
+	unsigned w;
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, &w, sizeof(w)) != sizeof(w)) {
+		err(1, "read");
+	}
+	return w;
+}
+
+/* Writes through shared mappings reach the file and other processes */
+static
+void
+test_shared(const char *name, size_t size)
+{
+	unsigned *p;
+	size_t n = size / sizeof(unsigned);
+	int fd, status;
+	pid_t pid;
+
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap shared", name);
+	}
+
+	p[0] = 0xdeadbeef;
+	p[n - 1] = 0xfeedface;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (p[0] != 0xdeadbeef) {
+			errx(1, "child doesn't see the parent's write");
+		}
+		p[n / 2] = 0xcafef00d;
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	if (p[n / 2] != 0xcafef00d) {
+		errx(1, "parent doesn't see the child's write");
+	}
+
+	if (munmap(p, size) < 0) {
+		err(1, "munmap");
+	}
+
+	/* Everything has been unmapped, so it's all in the file now */
+	if (readword(fd, 0) != 0xdeadbeef ||
+	    readword(fd, (n - 1) * sizeof(unsigned)) != 0xfeedface ||
+	    readword(fd, (n / 2) * sizeof(unsigned)) != 0xcafef00d) {
+		errx(1, "shared writes didn't make it to the file");
+	}
+	close(fd);
+	printf("mmapscan: shared mapping ok\n");
+}
+
+/* Writes through private mappings stay private */
+static
+void
+test_private(const char *name, size_t size)
+{
+	unsigned *p;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap private", name);
+	}
+	if (p[1] != word(1)) {
+		errx(1, "private mapping has the wrong contents");
+	}
+	p[1] = 0;
+	if (munmap(p, size) < 0) {
+		err(1, "munmap");
+	}
+	if (readword(fd, sizeof(unsigned)) != word(1)) {
+		errx(1, "private write made it to the file");
+	}
+	close(fd);
+	printf("mmapscan: private mapping ok\n");
+}
+
+/* Anonymous memory starts out zero and can be unmapped a page at a time */
+static
+void
+test_anon(void)
+{
+	unsigned char *p;
+	size_t size = 16 * PAGE_SIZE;
+	size_t i;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anon");
+	}
+	for (i = 0; i < size; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous memory isn't zero at %u", i);
+		}
+	}
+	memset(p, 0xa5, size);
+
+	/* Punch a hole in the middle, then unmap the rest around it */
+	if (munmap(p + 4 * PAGE_SIZE, 4 * PAGE_SIZE) < 0) {
+		err(1, "munmap middle");
+	}
+	for (i = 0; i < size; i++) {
+		if ((i < 4 * PAGE_SIZE || i >= 8 * PAGE_SIZE) && p[i] != 0xa5) {
+			errx(1, "anonymous memory lost at %u", i);
+		}
+	}
+	if (munmap(p, size) < 0) {
+		err(1, "munmap");
+	}
+	printf("mmapscan: anonymous mapping ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *name = DEFAULT_FILE;
+	unsigned long sizekb = DEFAULT_SIZE_KB;
+	struct stamp t0, t1, t2;
+	unsigned rsum, msum, expected = 0;
+	size_t size, i;
+
+	if (argc > 1) {
+		name = argv[1];
+	}
+	if (argc > 2) {
+		sizekb = atoi(argv[2]);
+	}
+	size = (sizekb * 1024 + CHUNK - 1) / CHUNK * CHUNK;
+	if (size == 0) {
+		errx(1, "Usage: mmapscan [filename] [size-kb]");
+	}
+
+	for (i = 0; i < size / sizeof(unsigned); i++) {
+		expected += word(i);
+	}
+
+	makefile(name, size);
+
+	__time(&t0.s, &t0.ns);
+	rsum = scan_read(name, size);
+	__time(&t1.s, &t1.ns);
+	msum = scan_mmap(name, size);
+	__time(&t2.s, &t2.ns);
+
+	if (rsum != expected || msum != expected) {
+		errx(1, "sums don't match: read %u, mmap %u, expected %u",
+		     rsum, msum, expected);
+	}
+	printf("mmapscan: %u bytes, read %lu usec, mmap %lu usec\n",
+	       size, elapsed_usec(&t0, &t1), elapsed_usec(&t1, &t2));
+
+	test_private(name, size);
+	test_shared(name, size);
+	test_anon();
+
+	remove(name);
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * shmipc - hand data from one process to another through shared memory,
+ * and through a file, and compare the throughput.
+ *
+ * Usage: shmipc [size-kb]
+ *
+ * The parent produces SIZE-KB of data a buffer at a time and the child
+ * consumes it, checking every word. They take turns through a control
+ * page in a shared memory segment: the parent bumps seq when a buffer is
+ * ready and the child bumps ack when it is done with it. The data goes
+ *
+ *    - through a second shared memory segment, which both write and read
+ *      directly, so nothing gets copied;
+ *    - through a file, which costs a copy in and a copy out per buffer,
+ *      plus whatever the file system does with it.
+ *
+ * Both segments are attached before the fork, so the child also checks
+ * that attachments are inherited.
+ */
+
+#include <sys/shm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define BUFSIZE (16 * 1024)
+#define NWORDS (BUFSIZE / sizeof(unsigned))
+
+#define DEFAULT_SIZE_KB 1024
+
+static const char name[] = "shmipc.tmp";
+
+struct stamp {
+	time_t s;
+	unsigned long ns;
+};
+
+struct control {
+	volatile unsigned seq;
+	volatile unsigned ack;
+	volatile unsigned bad;
+};
+
+static struct control *ctl;
+static unsigned *buf;
+
+static
+unsigned long
+elapsed_usec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000UL + t1->ns / 1000 - t0->ns / 1000;
+}
+
+static
+void *
+getsegment(size_t size, int *id)
+{
+	void *p;
+
+	*id = shmget(IPC_PRIVATE, size, IPC_CREAT);
+	if (*id < 0) {
+		err(1, "shmget");
+	}
+	p = shmat(*id, NULL, 0);
+	if (p == (void *)-1) {
+		err(1, "shmat");
+	}
+	return p;
+}
+
+/* Fill a buffer with what the consumer expects to find in buffer I */
+static
+void
+produce(unsigned *p, unsigned i)
+{
+	unsigned j;
+
+	for (j = 0; j < NWORDS; j++) {
+		p[j] = i * NWORDS + j;
+	}
+}
+
+/* Check buffer I, returning how many words are wrong */
+static
+unsigned
+consume(const unsigned *p, unsigned i)
+{
+	unsigned j, bad = 0;
+
+	for (j = 0; j < NWORDS; j++) {
+		if (p[j] != i * NWORDS + j) {
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+ * Hand NBUFS buffers to the child, through the file if USEFILE is set and
+ * through the shared buffer otherwise. Returns how long it took.
+ */
+static
+unsigned long
+handoff(unsigned nbufs, int usefile)
+{
+	static unsigned local[NWORDS];
+	struct stamp t0, t1;
+	unsigned i;
+	pid_t pid;
+	int fd = -1, status;
+
+	if (usefile) {
+		fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0664);
+		if (fd < 0) {
+			err(1, "%s", name);
+		}
+	}
+
+	ctl->seq = 0;
+	ctl->ack = 0;
+	ctl->bad = 0;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i = 0; i < nbufs; i++) {
+			while (ctl->seq == i) {
+				/* wait for the parent */
+			}
+			if (usefile) {
+				if (lseek(fd, 0, SEEK_SET) < 0 ||
+				    read(fd, local, BUFSIZE) != BUFSIZE) {
+					err(1, "%s: read", name);
+				}
+				ctl->bad += consume(local, i);
+			}
+			else {
+				ctl->bad += consume(buf, i);
+			}
+			ctl->ack = i + 1;
+		}
+		_exit(0);
+	}
+
+	__time(&t0.s, &t0.ns);
+	for (i = 0; i < nbufs; i++) {
+		while (ctl->ack != i) {
+			/* wait for the child */
+		}
+		if (usefile) {
+			produce(local, i);
+			if (lseek(fd, 0, SEEK_SET) < 0 ||
+			    write(fd, local, BUFSIZE) != BUFSIZE) {
+				err(1, "%s: write", name);
+			}
+		}
+		else {
+			produce(buf, i);
+		}
+		ctl->seq = i + 1;
+	}
+	while (ctl->ack != nbufs) {
+		/* wait for the last buffer */
+	}
+	__time(&t1.s, &t1.ns);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (usefile) {
+		close(fd);
+		remove(name);
+	}
+	if (ctl->bad > 0) {
+		errx(1, "Failed: %u words came through wrong through %s",
+		     ctl->bad, usefile ? "the file" : "shared memory");
+	}
+	return elapsed_usec(&t0, &t1);
+}
+
+static
+void
+report(const char *how, unsigned long kb, unsigned long usec)
+{
+	unsigned long msec;
+
+	/* Milliseconds are fine enough, and keep the math in 32 bits */
+	msec = usec / 1000 > 0 ? usec / 1000 : 1;
+	printf("shmipc: %lu KB through %s: %lu usec, %lu KB/s\n",
+	       kb, how, usec, kb * 1000 / msec);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long sizekb = DEFAULT_SIZE_KB;
+	unsigned long shmusec, fileusec;
+	struct shmid_ds ds;
+	unsigned nbufs;
+	int ctlid, bufid;
+
+	if (argc > 1) {
+		sizekb = atoi(argv[1]);
+	}
+	nbufs = (sizekb * 1024 + BUFSIZE - 1) / BUFSIZE;
+	if (nbufs == 0) {
+		errx(1, "Usage: shmipc [size-kb]");
+	}
+	sizekb = nbufs * (BUFSIZE / 1024);
+
+	ctl = getsegment(sizeof(struct control), &ctlid);
+	buf = getsegment(BUFSIZE, &bufid);
+
+	if (shmctl(bufid, IPC_STAT, &ds) < 0) {
+		err(1, "shmctl IPC_STAT");
+	}
+	if (ds.shm_segsz < BUFSIZE || ds.shm_nattch != 1) {
+		errx(1, "Failed: IPC_STAT says %u bytes, %u attachments",
+		     ds.shm_segsz, ds.shm_nattch);
+	}
+
+	shmusec = handoff(nbufs, 0);
+	fileusec = handoff(nbufs, 1);
+
+	report("shared memory", sizekb, shmusec);
+	report("a file", sizekb, fileusec);
+
+	/* Removed segments stay until the last detach */
+	if (shmctl(bufid, IPC_RMID, NULL) < 0 ||
+	    shmctl(ctlid, IPC_RMID, NULL) < 0) {
+		err(1, "shmctl IPC_RMID");
+	}
+	if (buf[0] != (nbufs - 1) * NWORDS) {
+		errx(1, "Failed: removed segment lost its contents");
+	}
+	if (shmdt(buf) < 0 || shmdt(ctl) < 0) {
+		err(1, "shmdt");
+	}
+	return 0;
+}
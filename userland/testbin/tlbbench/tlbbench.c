@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tlbbench - measure the cost of a TLB miss on a resident page.
+ *
+ * Usage: tlbbench [pages] [rounds]
+ *
+ * Touches every page of a heap region once to fault it in, then sweeps
+ * over all of them a number of times. With more pages than TLB entries
+ * (the TLB has 64), nearly every access in the sweep is a TLB miss on a
+ * page that is already resident, which is exactly what the refill path
+ * has to handle. A second run over a handful of pages that fit in the
+ * TLB gives the baseline cost of the loop itself.
+ *
+ * Don't use more pages than fit in memory, or you'll be measuring swap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+#define DEFAULT_PAGES 512
+#define DEFAULT_ROUNDS 50
+#define BASELINE_PAGES 8
+
+/*
+ * Touch the first byte of npages pages, round robin, naccesses times.
+ * Returns the time taken in microseconds.
+ */
+static
+unsigned long
+sweep(volatile char *mem, unsigned npages, unsigned naccesses)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned i;
+
+	__time(&s0, &ns0);
+	for (i = 0; i < naccesses; i++) {
+		mem[(i % npages) * PAGE_SIZE]++;
+	}
+	__time(&s1, &ns1);
+
+	return (s1 - s0) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+/*
+ * Nanoseconds per access, without overflowing 32 bits.
+ */
+static
+unsigned long
+ns_per(unsigned long usec, unsigned naccesses)
+{
+	return (usec / naccesses) * 1000 +
+		(usec % naccesses) * 1000 / naccesses;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned npages = DEFAULT_PAGES;
+	unsigned rounds = DEFAULT_ROUNDS;
+	unsigned naccesses, i;
+	unsigned long miss_usec, base_usec;
+	volatile char *mem;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rounds = atoi(argv[2]);
+	}
+	if (npages <= BASELINE_PAGES || rounds == 0) {
+		errx(1, "Usage: tlbbench [pages > %d] [rounds]",
+		     BASELINE_PAGES);
+	}
+
+	mem = sbrk(npages * PAGE_SIZE);
+	if (mem == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	/* Fault everything in first. */
+	for (i = 0; i < npages; i++) {
+		mem[i * PAGE_SIZE] = 0;
+	}
+
+	naccesses = npages * rounds;
+	miss_usec = sweep(mem, npages, naccesses);
+	base_usec = sweep(mem, BASELINE_PAGES, naccesses);
+
+	printf("tlbbench: %u pages, %u accesses\n", npages, naccesses);
+	printf("tlbbench: %lu ns per access over %u pages\n",
+	       ns_per(miss_usec, naccesses), npages);
+	printf("tlbbench: %lu ns per access over %u pages (no misses)\n",
+	       ns_per(base_usec, naccesses), BASELINE_PAGES);
+	if (miss_usec > base_usec) {
+		printf("tlbbench: about %lu ns per TLB miss\n",
+		       ns_per(miss_usec - base_usec, naccesses));
+	}
+
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tlbpong - measure what switching between two processes costs in TLB
+ * refills.
+ *
+ * Usage: tlbpong [pages] [rounds]
+ *
+ * A parent and a child take turns through a pair of semfs semaphores,
+ * so every turn is a context switch from one address space to the
+ * other. On each of its turns, each of them touches every page of its
+ * own working set. The parent times that twice: right after the switch,
+ * when whatever of its entries didn't survive the child's turn have to
+ * be refilled, and once more straight after, when they are all in the
+ * TLB. The difference is what the switch cost in refills.
+ *
+ * If the TLB is flushed on every switch, every page of the first pass
+ * misses. If entries are tagged with address space IDs and both working
+ * sets fit (the TLB has 64 entries), next to none do. Run it with and
+ * without that in the kernel, and compare the flush counts in vmstat.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+
+#define DEFAULT_PAGES 16
+#define DEFAULT_ROUNDS 500
+
+#define PINGSEM "sem:tlbpong-ping"
+#define PONGSEM "sem:tlbpong-pong"
+
+struct stamp {
+	time_t s;
+	unsigned long ns;
+};
+
+/* Only for short intervals; 32 bits of nanoseconds is about 4 seconds */
+static
+unsigned long
+elapsed_nsec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000000UL + t1->ns - t0->ns;
+}
+
+static
+unsigned long
+elapsed_usec(const struct stamp *t0, const struct stamp *t1)
+{
+	return (t1->s - t0->s) * 1000000UL + t1->ns / 1000 - t0->ns / 1000;
+}
+
+static
+int
+opensem(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	return fd;
+}
+
+static
+void
+P(int fd)
+{
+	char c;
+
+	if (read(fd, &c, 1) != 1) {
+		err(1, "P");
+	}
+}
+
+static
+void
+V(int fd)
+{
+	char c = 0;
+
+	if (write(fd, &c, 1) != 1) {
+		err(1, "V");
+	}
+}
+
+/* Write to the first byte of each of npages pages */
+static
+void
+touch(volatile char *mem, unsigned npages)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		mem[i * PAGE_SIZE]++;
+	}
+}
+
+/* Time touching npages pages, in nanoseconds */
+static
+unsigned long
+timetouch(volatile char *mem, unsigned npages)
+{
+	struct stamp t0, t1;
+
+	__time(&t0.s, &t0.ns);
+	touch(mem, npages);
+	__time(&t1.s, &t1.ns);
+	return elapsed_nsec(&t0, &t1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned npages = DEFAULT_PAGES;
+	unsigned rounds = DEFAULT_ROUNDS;
+	unsigned long first = 0, again = 0;
+	struct stamp t0, t1;
+	volatile char *mem;
+	unsigned i;
+	int ping, pong, status;
+	pid_t pid;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rounds = atoi(argv[2]);
+	}
+	if (npages == 0 || rounds == 0) {
+		errx(1, "Usage: tlbpong [pages] [rounds]");
+	}
+
+	mem = sbrk(npages * PAGE_SIZE);
+	if (mem == (void *)-1) {
+		err(1, "sbrk");
+	}
+	touch(mem, npages);
+
+	ping = opensem(PINGSEM);
+	pong = opensem(PONGSEM);
+
+	/* The child gets its own copy of the pages, and so its own mappings */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i = 0; i < rounds; i++) {
+			P(ping);
+			touch(mem, npages);
+			V(pong);
+		}
+		_exit(0);
+	}
+
+	__time(&t0.s, &t0.ns);
+	for (i = 0; i < rounds; i++) {
+		V(ping);
+		P(pong);
+		first += timetouch(mem, npages);
+		again += timetouch(mem, npages);
+	}
+	__time(&t1.s, &t1.ns);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	close(ping);
+	close(pong);
+	remove(PINGSEM);
+	remove(PONGSEM);
+	if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child %d failed", pid);
+	}
+
+	printf("tlbpong: %u pages, %u rounds, %lu usec per round trip\n",
+	       npages, rounds, elapsed_usec(&t0, &t1) / rounds);
+	printf("tlbpong: %lu ns per page after a switch, %lu ns per page "
+	       "after that\n", first / rounds / npages,
+	       again / rounds / npages);
+	if (first > again) {
+		printf("tlbpong: about %lu ns per page in refills per switch\n",
+		       (first - again) / rounds / npages);
+	}
+	return 0;
+}